@@ -1,18 +1,45 @@
 #include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
 #include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** Defines ***/
 
 #define CTRL_KEY(k) ((k) & 0x1f)
-#define MAX_LINES 100
 #define MAX_SEARCH_LEN 80
+#define MAX_MATCHES 1000
+#define READ_CHUNK 65536
+#define DIFF_MAX_COST 4096 // give up on finer hunks past this many edits
+#define POOL_CLASSES 9 // line size classes 16 bytes .. 4 KB, bigger lines use malloc
+#define POOL_SLAB 65536
+#define GREP_MAX_LINE 200 // longest line text kept in a grep result
+#define PAGER_MIN_SIZE (256LL << 20) // files this big open read-only in the pager instead of being read into lines
+#define PAGER_STEP 4096 // lines between two marks of the pager's line index
+#define PAGER_CHUNK (64 << 20) // bytes the pager scans before dropping their pages again
 
 /*** Terminal ***/
 
@@ -39,25 +66,338 @@ void setupResizeHandler() {
 
 /*** Editor State ***/
 
-int cx;
-int cy;
-char *lines[MAX_LINES];
-int num_lines;
-const char *current_filename;
+struct Cursor {
+    int x, y;
+};
+
+// counts for one line or a run of lines; a line's own newline is included
+struct LineStats {
+    long long bytes;
+    long long words; // runs of non-space bytes
+    long long chars; // UTF-8 characters
+};
+
+#define STATS_BLOCK 512 // lines per block of cached counts, an edit moves at most this many
+#define STATS_FILL (STATS_BLOCK * 3 / 4) // fresh blocks leave room to insert before they split
+
+// cached counts of a run of lines
+struct StatsBlock {
+    int n;
+    struct LineStats sum;
+    struct LineStats line[STATS_BLOCK];
+};
+
+// brackets of a line or a run of lines, openers +1 and closers -1 of any kind
+struct BracketSum {
+    int net;
+    int minpre; // lowest running sum from the start, 0 or less
+    int maxsuf; // highest sum of a suffix, 0 or more; -1 marks a line to rescan
+};
+
+// lines start + 1 .. end are hidden behind the start line
+struct Fold {
+    int start, end;
+};
+
+// one open file, switching buffers only swaps the B pointer
+#define MAX_MARKS 26
+
+// a named mark; line is relative to the shifts stored for it in mark_shift
+struct Mark {
+    int line, col;
+    char name;
+};
+
+struct Buffer {
+    char **lines;
+    int num_lines;
+    int lines_cap; // allocated slots in lines, unused slots are NULL
+    int cx;
+    int cy;
+    int rowoff; // row offset for scrolling
+    const char *filename;
+    int dirty; // buffer has edits that are not on disk
+    int follow_mode; // 1 = tail the file as it grows
+    off_t file_size; // bytes of the file already read into lines
+    int tail_open; // last line was read without a trailing newline
+    int watch_wd; // inotify watch, -1 when not watched
+    struct stat watch_st; // last seen size/mtime for the stat() fallback
+    int disk_changed; // watch fired, handled once the buffer is current
+    int search_mode; // 0 = not searching, 1 = entering query, 2 = active search
+    char search_query[MAX_SEARCH_LEN];
+    int search_query_len;
+    struct { int x, y; } search_matches[MAX_MATCHES]; // store match positions
+    int num_matches;
+    int current_match; // index of current match in search_matches
+    int match_gen; // bumped whenever search_matches or the rows showing them change
+    int scratch; // results list, not backed by a file
+    int binary; // the file has NUL bytes, it is only shown in the hex view and never read into lines
+    int large; // the file is at least PAGER_MIN_SIZE, it is only shown in the pager and never read into lines
+    struct Cursor *cursors; // extra cursors besides cx/cy, edited together with it
+    int num_cursors;
+    int cursors_cap;
+    int filter_on; // only lines containing filter_query are shown
+    char filter_query[MAX_SEARCH_LEN];
+    int *filter_lines; // ascending line numbers, row i of the view shows filter_lines[i]
+    int filter_count;
+    int filter_cap;
+    int filter_scanned; // lines below this have been checked against the query
+    struct Fold *folds; // sorted, never overlapping; an opened fold may stay behind empty until the next rebuild
+    int num_folds;
+    int folds_cap;
+    int *fold_tree; // Fenwick tree over folds, of the lines each one hides
+    int fold_hidden; // lines hidden by all folds
+    int fold_dirty; // folds were added or removed, rebuild the tree before the next lookup
+    struct StatsBlock **stats_blocks; // cached counts per line, in runs of at most STATS_BLOCK lines
+    int stats_nblocks;
+    int stats_blocks_cap;
+    struct LineStats *stats_tree; // Fenwick tree over the block sums
+    int *stats_lines; // Fenwick tree over the block line counts
+    int stats_n; // lines counted, a mismatch with num_lines recounts everything
+    int stats_dirty; // blocks were split, merged or dropped, rebuild both trees
+    struct LineStats block_stats; // counts of the block selection
+    int block_rect[4]; // top, bottom, left and right block_stats was counted for
+    int block_stats_valid; // cleared by every edit
+    struct Mark marks[MAX_MARKS]; // sorted by line
+    int num_marks;
+    int mark_shift[MAX_MARKS + 1]; // Fenwick tree of line shifts, mark i moves by the prefix sum up to i
+    signed char mark_slot[MAX_MARKS]; // index in marks for each name, -1 if unset
+    struct WordIndex *words; // completion index, NULL until the first build
+    struct BracketSum *bracket_lines; // cached per line, NULL until a bracket is matched
+    struct BracketSum *bracket_tree; // segment tree, leaves at bracket_size + line
+    int bracket_n; // lines in bracket_lines, a mismatch with num_lines rescans everything
+    int bracket_cap;
+    int bracket_size;
+    int bracket_dirty; // rebuild the tree before the next lookup
+    char csv_delim; // column view separator, 0 when the view is off
+    int **csv_cells; // field table per line, NULL until the line is drawn or used
+    int csv_n; // lines in csv_cells, a mismatch with num_lines drops every table
+    int csv_cap;
+    int *csv_width; // widest cell seen in each column, at most CSV_MAX_WIDTH
+    int csv_cols;
+};
+
+struct Buffer **buffers;
+int num_buffers;
+int current_buffer;
+struct Buffer *B; // the buffer being edited, buffers[current_buffer]
 char statusmsg[80];
-int visual_mode;
+int visual_mode; // 0 = off, 1 = stream selection, 2 = block selection
 int sx, sy; // selection start coordinates
-char *clipboard; // buffer for copied text
-int clip_len; // length of clipboard content
-int rowoff; // row offset for scrolling
-int editor_rows = 24;
+int editor_rows = 24; // size of the active pane
 int editor_cols = 80;
-int search_mode; // 0 = not searching, 1 = entering query, 2 = active search
-char search_query[MAX_SEARCH_LEN];
-int search_query_len;
-struct { int x, y; } search_matches[MAX_LINES * 10]; // store match positions
-int num_matches;
-int current_match; // index of current match in search_matches
+int screen_rows = 24; // whole terminal, less the status bar
+int screen_cols = 80;
+int watch_fd = -1; // inotify descriptor shared by all buffers, or -1
+
+/*** Memory Pool ***/
+
+// line text for every buffer comes from here, freed lines are reused by any buffer
+void *lineAlloc(size_t n);
+void *lineRealloc(void *p, size_t n);
+void lineFree(void *p);
+
+/*** Buffers ***/
+
+struct Buffer *newBuffer(const char *filename);
+struct Buffer *openBuffer(const char *filename);
+int showBuffer(struct Buffer *b);
+void switchBuffer(int dir);
+
+/*** Panes ***/
+
+// node of the split tree, leaves are viewports onto a buffer
+struct Pane {
+    int split; // 0 = leaf, 'h' = first above second, 'v' = first left of second
+    struct Pane *parent, *first, *second;
+    struct Buffer *buf; // shared, never copied, between panes showing the same file
+    int cx, cy, rowoff; // viewport, kept in buf while this pane is active
+    int top, left, rows, cols; // screen rectangle set by layoutPanes
+    int damaged; // redraw this pane in the next frame
+    int *hl_first; // per visible row, first search match on it or -1
+    int hl_rows, hl_rowoff, hl_gen; // what hl_first was built for
+};
+
+struct Pane *root_pane;
+struct Pane *active_pane;
+int pane_prefix; // Ctrl-W was pressed, next key is a pane command
+int full_redraw = 1; // layout changed, clear and redraw every pane
+
+struct Pane *newPane(struct Buffer *buf);
+void layoutPanes(struct Pane *p, int top, int left, int rows, int cols);
+void activatePane(struct Pane *p);
+void splitPane(int dir);
+void closePane();
+void focusNextPane();
+void damageBuffer(struct Buffer *buf);
+
+/*** View ***/
+
+// panes show rows; without a filter row n is line n
+int numRows(struct Buffer *b);
+int rowToLine(struct Buffer *b, int row);
+int lineToRow(struct Buffer *b, int line);
+void scrollToCursor();
+void centerCursor();
+void toggleFilterView();
+void buildFilter(struct Buffer *b);
+void extendFilter(struct Buffer *b);
+void viewLinesInserted(struct Buffer *b, int at, int n);
+void viewLinesDeleted(struct Buffer *b, int at, int n);
+int lineHidden(struct Buffer *b, int line);
+int foldAt(struct Buffer *b, int line);
+void addFold(struct Buffer *b, int start, int end);
+void clearFolds(struct Buffer *b);
+void toggleFold();
+void revealLine(int line);
+
+/*** Line Index ***/
+
+struct LineStats spanStats(const char *line, int a, int end);
+void lineEdited(struct Buffer *b, int y, struct LineStats before, struct LineStats after);
+void lineAppended(struct Buffer *b);
+void lineChanged(struct Buffer *b, int y);
+void linesReplaced(struct Buffer *b, int first, int count, int n);
+void linesRemapped(struct Buffer *b, const int *from, int n);
+void statsInvalidate(struct Buffer *b);
+struct LineStats bufferStats(struct Buffer *b, int first, int last);
+struct LineStats selectionStats(int *lines);
+long long lineOffset(struct Buffer *b, int line);
+int lineAtOffset(struct Buffer *b, long long off, long long *col);
+void gotoLine(int line);
+void gotoPercent(int pct);
+void gotoByte(long long off);
+
+/*** Brackets ***/
+
+struct Cursor bracket_hl[2]; // the bracket under the cursor and its partner
+int bracket_hl_on;
+
+void bracketsChanged(struct Buffer *b, int y);
+void bracketsReplaced(struct Buffer *b, int first, int count, int n);
+void bracketsRemapped(struct Buffer *b, const int *from, int n);
+int findBracket(struct Buffer *b, int y, int x, struct Cursor *partner);
+void updateBracketHighlight();
+void jumpToBracket();
+
+/*** Columns ***/
+
+#define CSV_MAX_WIDTH 40 // a longer cell pushes the rest of its row right instead of widening the column
+
+int *csvCells(struct Buffer *b, int y);
+void csvChanged(struct Buffer *b, int y);
+void csvReplaced(struct Buffer *b, int first, int count, int n);
+void csvRemapped(struct Buffer *b, const int *from, int n);
+void toggleColumnView(const char *arg);
+void csvMeasure(struct Pane *p);
+int csvField(struct Buffer *b, int y, int x);
+int csvScreenX(struct Buffer *b, int y, int x);
+void csvJumpField(int dir);
+void csvKeepField(int y, int x);
+void deleteColumn(int first, int last, int col);
+
+/*** JSON ***/
+
+// walks the structural characters of one line, 64 bytes at a time
+struct JsonScan {
+    const char *line;
+    int len;
+    int base; // end of the block bits came from
+    uint64_t bits; // structural characters of that block not yet returned
+    uint64_t in_string; // all ones when the last block ended inside a string
+    uint64_t escaped; // 1 when the last block ended in an unpaired backslash
+};
+
+// reformatted text, built line by line
+#define JSON_VALUE 0 // a value, or the closer if the container is still empty
+#define JSON_KEY 1 // a string key, or the closer if the object is still empty
+#define JSON_COLON 2
+#define JSON_COMMA 3 // a comma or the closer
+
+struct JsonOut {
+    char **lines;
+    int n, cap;
+    char *cur; // line being built, reused for short lines and grown in place for long ones
+    int len, cur_cap;
+    char *stack; // open { and [ for checking the closers
+    int depth, stack_cap;
+    int open; // a container was just opened and has nothing in it yet
+    int want; // what the innermost container takes next, one of the JSON_ states
+    int pretty;
+    const char *unit; // one indent step
+    int unit_len;
+};
+
+void formatJson(int first, int last, int pretty);
+void jsonNavigate(const char *dir);
+
+/*** Marks ***/
+
+int mark_prefix; // Ctrl-X or Ctrl-Y was pressed, next key names a mark
+
+void shiftMarks(struct Buffer *b, int at, int delta);
+void setMark(int name);
+void jumpMark(int name);
+int markLine(struct Buffer *b, int name);
+void listMarks();
+
+/*** Word Index ***/
+
+#define WORD_MIN_LEN 2 // shorter words are not worth completing
+#define WORD_MAX_LEN 64
+#define WORD_RECENT_MAX 4096 // new words wait in recent until this many, then merge into main
+#define COMPLETE_MAX 8
+#define WORD_COPY_SLICE (4 << 20) // bytes copied into a build snapshot per main loop pass
+
+// sorted distinct words and their counts; best is a tree holding the most frequent word of each range
+struct WordTable {
+    char **words;
+    int *count;
+    int n;
+    int *best;
+    int size; // leaves in best, a power of two
+};
+
+// a word change made while a build was running, replayed onto its result
+struct WordDelta {
+    char *word;
+    int delta;
+};
+
+struct WordIndex {
+    struct WordTable main; // built in the background from a snapshot of the buffer
+    struct WordTable recent; // words first seen since then, kept small so inserts stay cheap
+    int stale; // an edit was not tracked, rebuild on the next completion
+    int ready; // a build has finished, main can answer queries
+    int copying; // the snapshot is being filled a slice per main loop pass
+    int copy_line; // lines above this are in the snapshot
+    int building; // the snapshot is complete and being counted
+    int threaded; // the count runs on thread, it ran inline when none could start
+    pthread_t thread;
+    atomic_int built; // the thread has filled next
+    struct WordTable next;
+    char *snapshot; // lines joined by newlines, owned by the thread while it runs
+    size_t snapshot_len;
+    size_t snapshot_cap;
+    struct WordDelta *pending; // edits to text already in the snapshot
+    int num_pending;
+    int pending_cap;
+};
+
+char complete_words[COMPLETE_MAX][WORD_MAX_LEN + 1]; // candidates offered by the last Tab
+int complete_count; // 0 when the last key was not a completion
+int complete_pick; // candidate in the buffer now, complete_count means just the prefix
+int complete_prefix; // length of the word the user typed
+int complete_y, complete_x; // cursor right after the last completion
+
+void startWordIndex(struct Buffer *b);
+void pollWordIndex();
+void indexSpan(struct Buffer *b, int y, const char *line, int a, int end, int delta);
+void indexLine(struct Buffer *b, int y, const char *line, int delta);
+void wordsStale(struct Buffer *b);
+void wordsReplaced(struct Buffer *b, int first, int count, int n);
+void wordsMoved(struct Buffer *b);
+void completeWord();
 
 /*** Input ***/
 
@@ -65,9 +405,14 @@ enum EditorKey {
     ARROW_LEFT = 1000,
     ARROW_RIGHT,
     ARROW_UP,
-    ARROW_DOWN
+    ARROW_DOWN,
+    SHIFT_TAB
 };
 
+int auto_indent; // set only while a typed key is inserted, pasted text keeps its own indent
+int pending_keys[64]; // typed while a filter ran, readKey hands them out first
+int num_pending_keys;
+
 int readKey();
 void moveCursor(int key);
 void insertChar(int c);
@@ -79,22 +424,259 @@ void copySelection();
 void cutSelection();
 void deleteSelection();
 void pasteClipboard();
+void toggleBlockMode();
+void blockBounds(int *top, int *bottom, int *left, int *right);
+void copyBlock();
+void deleteBlock();
+
+/*** Registers ***/
+
+#define YANK_RING 10
+#define OSC52_CHUNK 3072 // bytes of text per base64 write, a multiple of 3
+
+// yanked text, never modified after it is filled, shared by the ring and registers
+struct Span {
+    int refs;
+    int len;
+    int block; // one row per line, pasted as a column block
+    char text[];
+};
+
+struct Span *registers[26]; // "a to "z
+struct Span *yank_ring[YANK_RING]; // [0] is the latest yank, what p pastes
+int yank_register = -1; // register named with " for the next yank
+int register_prefix; // '"' in visual mode or Ctrl-R, next key names a register
+
+struct Span *newSpan(int len, int block);
+void spanRef(struct Span *s);
+void spanUnref(struct Span *s);
+void storeYank(struct Span *s);
+void pasteSpan(struct Span *s);
+void pasteBlock(struct Span *s);
+void pasteRegister(int c);
+void sendOsc52(struct Span *s);
+
+/*** Macros ***/
+
+int *macro_keys; // keys as returned by readKey
+int macro_len;
+int macro_cap;
+int macro_recording;
+int macro_playing; // readKey replays macro_keys and the screen is not redrawn
+int macro_pos;
+int macro_failed; // set by a command that could not do its job, ends playback
+
+void toggleMacroRecording();
+void enterMacroPrompt();
+void playMacro(int count);
+
+/*** Command Line ***/
+
+void enterCommandMode();
+void runCommand(const char *cmd);
+void replaceLines(int first, int count, char **repl, int n);
+void substituteLines(int first, int last, const char *arg);
+void globalDelete(int first, int last, const char *arg, int invert);
+void reindentLines(int first, int last);
+void filterLines(int first, int last, const char *cmd);
+
+/*** Sort ***/
+
+#define SORT_MIN_CHUNK 65536 // fewer lines than this per thread is not worth a thread
+#define SORT_MAX_THREADS 16
+
+// one line to sort; the line text is never copied, only these records move
+struct SortRec {
+    uint64_t prefix; // first 8 key bytes big-endian, or the number for n, inverted for r
+    char *line;
+    int off, len; // key within line
+};
+
+struct SortJob {
+    struct SortRec *a, *tmp;
+    int lo, mid, hi; // sort [lo, hi), or merge [lo, mid) with [mid, hi)
+    int numeric, reverse, field;
+    char **lines; // keys are read from here when the job builds its records
+    int first; // buffer line of lines[0], for field tables in the column view
+};
+
+void sortLines(int first, int last, const char *opts);
+
+enum PromptKind {
+    PROMPT_SEARCH,
+    PROMPT_GREP,
+    PROMPT_MACRO,
+    PROMPT_COMMAND
+};
+
+int prompt_kind; // what the status-line input is for while search_mode == 1
+const char *prompt_label = "[Search Mode] Enter query: ";
+
 void enterSearchMode();
 void exitSearchMode();
+void collectMatches();
 void performSearch();
 void findNext();
 void findPrevious();
 
+/*** Multiple Cursors ***/
+
+void addCursor(int x, int y);
+void clearCursors();
+void addCursorAtNextMatch();
+void addCursorBelow();
+void multiInsertChar(int c);
+void multiDeleteChar();
+void multiInsertNewline();
+
 /*** Output ***/
 
-void editorDrawRows();
-void drawStatusBar();
+// frame under construction, written to the terminal in one go
+struct abuf {
+    char *b;
+    int len;
+};
+
+void abAppend(struct abuf *ab, const char *s, int len);
+void editorDrawRows(struct abuf *ab);
+void drawStatusBar(struct abuf *ab);
 void editorRefreshScreen();
 
 /*** File I/O ***/
 
 void saveFile(const char *filename);
 void loadFile(const char *filename);
+int mapFile(const char *filename, char **map, size_t *size);
+void ensureLineCapacity(int n);
+void freeLines();
+
+/*** File Watch ***/
+
+void startWatch(const char *filename);
+int pollWatch();
+void ingestAppend();
+void toggleFollowMode();
+void reloadFile();
+
+/*** Diff ***/
+
+struct DiffHunk {
+    int a_start, a_len; // lines replaced in the old text
+    int b_start, b_len; // lines replacing them from the new text
+};
+
+// lines of a mapped file, pointing into the mapping rather than copied
+struct LineIndex {
+    const char **ptr;
+    int *len;
+    uint64_t *hash;
+    int count;
+};
+
+uint64_t hashLine(const char *s, int len);
+uint64_t *hashBufferLines();
+void indexText(const char *text, size_t size, struct LineIndex *idx);
+void freeLineIndex(struct LineIndex *idx);
+int diffHashes(const uint64_t *a, int n, const uint64_t *b, int m, struct DiffHunk **hunks);
+
+/*** Diff View ***/
+
+int diff_view; // 0 = off, 1 = worker computing, 2 = showing hunks
+atomic_int diff_ready; // set by the worker once the hunks are published
+pthread_t diff_thread;
+char *diff_map; // on-disk file, the old side of the diff
+size_t diff_map_size;
+struct LineIndex diff_disk;
+struct DiffHunk *diff_hunks;
+int diff_num_hunks;
+int *diff_row_start; // display row of each hunk's first line
+int diff_rows; // total display rows, buffer lines plus deleted disk lines
+int diff_rowoff;
+
+void enterDiffView();
+void exitDiffView();
+void pollDiffView();
+int diffRowAt(int row, int *line);
+void diffJumpHunk(int dir);
+
+/*** Hex View ***/
+
+// a byte typed over the file, kept until it is written back
+struct HexPatch {
+    off_t off;
+    unsigned char byte;
+};
+
+int hex_view; // the current buffer is shown as hex
+char *hex_map; // the file, mapped read-only; only the rows on screen are touched
+size_t hex_size;
+off_t hex_cursor; // byte under the cursor
+off_t hex_rowoff; // first row shown
+int hex_low; // the next hex digit sets the low half of the byte
+int hex_text; // typing goes into the text column
+struct HexPatch *hex_patches; // sorted by offset
+int hex_num_patches;
+int hex_patches_cap;
+int hex_drop; // Esc was pressed with unsaved patches, again drops them
+
+void enterHexView();
+void exitHexView();
+int hexByte(off_t off, int *patched);
+void hexPatch(off_t off, unsigned char byte);
+void saveHexPatches();
+void hexGoto(off_t off);
+int hexCommand(const char *cmd);
+void hexKeypress(int c);
+
+/*** Pager ***/
+
+int pager_view; // the current buffer's file is shown read-only, straight from disk
+char *pager_map; // the file, mapped read-only; only the rows on screen and the bytes being scanned are touched
+size_t pager_size;
+off_t *pager_marks; // pager_marks[k] is where line k * PAGER_STEP starts
+int pager_num_marks;
+int pager_marks_cap;
+off_t pager_scanned; // bytes already counted into pager_marks
+long long pager_scanned_lines; // newlines in those bytes
+off_t pager_top; // first byte of the top row
+long long pager_line; // line number of the top row, from 0
+int pager_coloff; // columns scrolled off to the left
+off_t pager_match; // start of the last match found, -1 when there is none
+int pager_changed; // the file changed on disk while it was paged
+
+void enterPagerView();
+void exitPagerView();
+void pagerGotoLine(long long line);
+void pagerGotoByte(off_t off);
+void pagerSearch(int dir);
+void pagerReload();
+int pagerCommand(const char *cmd);
+void pagerKeypress(int c);
+
+/*** Grep ***/
+
+struct Buffer *grep_buf; // results list, reused by every grep
+char grep_pattern[MAX_SEARCH_LEN];
+pthread_t grep_thread; // walks the tree, then runs the worker pool
+int grep_running;
+atomic_int grep_done;
+char **grep_files;
+int grep_num_files;
+int grep_files_cap;
+atomic_int grep_next_file; // workers take files from here
+atomic_int grep_files_searched;
+pthread_mutex_t grep_lock = PTHREAD_MUTEX_INITIALIZER; // guards grep_pending
+char **grep_pending; // "path:line:text" hits waiting to enter grep_buf
+int *grep_pending_path; // length of the path in each pending hit
+int grep_num_pending;
+int grep_pending_cap;
+int *grep_path_len; // length of the path in each line of grep_buf, paths may hold ':' themselves
+int grep_path_cap;
+
+void enterGrepMode();
+void startGrep(const char *pattern);
+int pollGrep();
+void jumpToGrepResult();
 
 /*** Terminal Setup ***/
 
@@ -125,527 +707,5764 @@ void enableRawMode() {
 /*** Search Functions ***/
 
 void enterSearchMode() {
-    search_mode = 1;
-    search_query[0] = '\0';
-    search_query_len = 0;
-    num_matches = 0;
-    current_match = -1;
-    snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Enter query: ");
+    B->search_mode = 1;
+    B->search_query[0] = '\0';
+    B->search_query_len = 0;
+    B->num_matches = 0;
+    B->current_match = -1;
+    prompt_kind = PROMPT_SEARCH;
+    prompt_label = "[Search Mode] Enter query: ";
+    snprintf(statusmsg, sizeof(statusmsg), "%s", prompt_label);
     editorRefreshScreen();
 }
 
 void exitSearchMode() {
-    search_mode = 0;
+    B->search_mode = 0;
     snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
     editorRefreshScreen();
 }
 
+void collectMatches() {
+    B->num_matches = 0;
+    B->match_gen++;
+    for (int y = 0; y < B->num_lines; y++) {
+        if (!B->lines[y]) continue;
+        char *pos = B->lines[y];
+        while ((pos = strstr(pos, B->search_query)) != NULL) {
+            if (B->num_matches < MAX_MATCHES) {
+                B->search_matches[B->num_matches].x = pos - B->lines[y];
+                B->search_matches[B->num_matches].y = y;
+                B->num_matches++;
+            }
+            pos++; // move past current match
+        }
+    }
+}
+
 void performSearch() {
-    if (search_query_len == 0) {
+    if (B->search_query_len == 0) {
         exitSearchMode();
         return;
     }
+    if (pager_view) {
+        // the pager searches the file itself, a match at a time
+        B->search_mode = 0;
+        pager_match = -1;
+        pagerSearch(1);
+        editorRefreshScreen();
+        return;
+    }
 
-    num_matches = 0;
-    current_match = -1;
+    B->current_match = -1;
+    collectMatches();
 
-    for (int y = 0; y < num_lines; y++) {
-        if (!lines[y]) continue;
-        char *pos = lines[y];
-        while ((pos = strstr(pos, search_query)) != NULL) {
-            if (num_matches < MAX_LINES * 10) {
-                search_matches[num_matches].x = pos - lines[y];
-                search_matches[num_matches].y = y;
-                num_matches++;
-            }
-            pos++; // move past current match
-        }
-    }
+    // the first match that isn't folded away
+    int first = 0;
+    while (first < B->num_matches && lineHidden(B, B->search_matches[first].y)) first++;
+    if (first == B->num_matches) first = 0;
 
-    if (num_matches > 0) {
-        current_match = 0;
-        cx = search_matches[0].x;
-        cy = search_matches[0].y;
+    if (B->num_matches > 0) {
+        B->current_match = first;
+        B->cx = B->search_matches[first].x;
+        B->cy = B->search_matches[first].y;
+        revealLine(B->cy); // only when every match is folded
         // adjust scroll to show match
-        if (cy < rowoff) rowoff = cy;
-        if (cy >= rowoff + editor_rows) rowoff = cy - editor_rows + 1;
-        snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] %d matches found", num_matches);
+        scrollToCursor();
+        snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] %d matches found", B->num_matches);
     } else {
         snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] No matches found");
+        macro_failed = 1;
     }
 
-    search_mode = 2;
+    B->search_mode = 2;
     editorRefreshScreen();
 }
 
 void findNext() {
-    if (search_mode != 2 || num_matches == 0) return;
+    if (B->search_mode != 2 || B->num_matches == 0) {
+        macro_failed = 1;
+        return;
+    }
 
-    current_match = (current_match + 1) % num_matches;
-    cx = search_matches[current_match].x;
-    cy = search_matches[current_match].y;
+    // step over matches inside folds, giving up after a full lap
+    int i = 0;
+    do {
+        B->current_match = (B->current_match + 1) % B->num_matches;
+    } while (++i < B->num_matches && lineHidden(B, B->search_matches[B->current_match].y));
+    B->cx = B->search_matches[B->current_match].x;
+    B->cy = B->search_matches[B->current_match].y;
+    revealLine(B->cy);
 
     // adjust scroll to show match
-    if (cy < rowoff) rowoff = cy;
-    if (cy >= rowoff + editor_rows) rowoff = cy - editor_rows + 1;
+    scrollToCursor();
 
-    snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Match %d/%d", current_match + 1, num_matches);
+    snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Match %d/%d", B->current_match + 1, B->num_matches);
     editorRefreshScreen();
 }
 
 void findPrevious() {
-    if (search_mode != 2 || num_matches == 0) return;
+    if (B->search_mode != 2 || B->num_matches == 0) {
+        macro_failed = 1;
+        return;
+    }
 
-    current_match = (current_match - 1);
-    if (current_match < 0) current_match = num_matches - 1;
-    cx = search_matches[current_match].x;
-    cy = search_matches[current_match].y;
+    int i = 0;
+    do {
+        B->current_match = (B->current_match - 1);
+        if (B->current_match < 0) B->current_match = B->num_matches - 1;
+    } while (++i < B->num_matches && lineHidden(B, B->search_matches[B->current_match].y));
+    B->cx = B->search_matches[B->current_match].x;
+    B->cy = B->search_matches[B->current_match].y;
+    revealLine(B->cy);
 
     // adjust scroll to show match
-    if (cy < rowoff) rowoff = cy;
-    if (cy >= rowoff + editor_rows) rowoff = cy - editor_rows + 1;
+    scrollToCursor();
 
-    snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Match %d/%d", current_match + 1, num_matches);
+    snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Match %d/%d", B->current_match + 1, B->num_matches);
     editorRefreshScreen();
 }
 
-/*** Input Functions ***/
+/*** Grep Functions ***/
 
-int readKey() {
-    char c;
-    struct timeval tv = {0, 1000}; // 1ms timeout
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
+void enterGrepMode() {
+    enterSearchMode();
+    prompt_kind = PROMPT_GREP;
+    prompt_label = "[Grep] Search files for: ";
+    snprintf(statusmsg, sizeof(statusmsg), "%s", prompt_label);
+    editorRefreshScreen();
+}
 
-    // Wait for input with timeout
-    if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
-        return 0; // no input ready
-    }
+static void grepCollect(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
 
-    if (read(STDIN_FILENO, &c, 1) != 1) {
-        return 0; // read failed
-    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        // skip ., .. and hidden entries such as .git
+        if (ent->d_name[0] == '.') continue;
 
-    if (c == '\x1b') {
-        char seq[2];
-        // Check for next character
-        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
-            return '\x1b';
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(path, &st) == -1) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
         }
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (seq[0] == '[') {
-            if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
-                return '\x1b';
-            }
-            if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-            switch (seq[1]) {
-                case 'A': return ARROW_UP;
-                case 'B': return ARROW_DOWN;
-                case 'C': return ARROW_RIGHT;
-                case 'D': return ARROW_LEFT;
+        if (type == DT_DIR) {
+            grepCollect(path);
+        } else if (type == DT_REG) {
+            if (grep_num_files == grep_files_cap) {
+                grep_files_cap = grep_files_cap ? grep_files_cap * 2 : 256;
+                grep_files = realloc(grep_files, grep_files_cap * sizeof(char *));
             }
+            grep_files[grep_num_files++] = strdup(path);
         }
-        return '\x1b'; // consume unrecognized sequences
     }
-    return c;
+    closedir(d);
 }
 
-void moveCursor(int key) {
-    switch (key) {
-        case ARROW_LEFT:
-            if (cx > 0) cx--;
-            break;
-        case ARROW_RIGHT:
-            if (cx < editor_cols - 1) cx++;
-            break;
-        case ARROW_UP:
-            if (cy > 0) cy--;
-            break;
-        case ARROW_DOWN:
-            if (cy < num_lines - 1) cy++;
-            break;
+// memchr is vectorized in libc, so scan for the first byte and verify the rest
+static const char *findPattern(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m == 0 || n < m) return NULL;
+    const char *last = hay + n - m;
+    for (const char *p = hay; p <= last; p++) {
+        p = memchr(p, pat[0], last - p + 1);
+        if (!p) return NULL;
+        if (memcmp(p, pat, m) == 0) return p;
     }
+    return NULL;
+}
 
-    // adjust scroll offset
-    if (cy < rowoff) {
-        rowoff = cy;
+static void grepFile(const char *path) {
+    char *map;
+    size_t size;
+    if (mapFile(path, &map, &size) == -1 || !map) return;
+
+    // binary files almost always have a NUL near the start
+    if (memchr(map, '\0', size < 4096 ? size : 4096)) {
+        munmap(map, size);
+        return;
     }
-    if (cy >= rowoff + editor_rows) {
-        rowoff = cy - editor_rows + 1;
+
+    char **hits = NULL;
+    int num_hits = 0;
+    int plen = strlen(grep_pattern);
+    const char *end = map + size;
+    const char *line_start = map;
+    int line_no = 1;
+    const char *hit;
+    const char *p = map;
+    while ((hit = findPattern(p, end - p, grep_pattern, plen)) != NULL) {
+        const char *nl;
+        while ((nl = memchr(line_start, '\n', hit - line_start)) != NULL) {
+            line_no++;
+            line_start = nl + 1;
+        }
+        const char *eol = memchr(hit, '\n', end - hit);
+        if (!eol) eol = end;
+
+        int text_len = eol - line_start;
+        if (text_len > GREP_MAX_LINE) text_len = GREP_MAX_LINE;
+        char *result = malloc(strlen(path) + text_len + 16);
+        sprintf(result, "%s:%d:%.*s", path, line_no, text_len, line_start);
+        hits = realloc(hits, (num_hits + 1) * sizeof(char *));
+        hits[num_hits++] = result;
+
+        // one hit per line, like grep
+        if (eol == end) break;
+        p = eol + 1;
     }
+    munmap(map, size);
 
-    // ensure cursor x doesn't exceed line length
-    int len = lines[cy] ? strlen(lines[cy]) : 0;
-    if (cx > len) cx = len;
+    if (num_hits == 0) return;
+    pthread_mutex_lock(&grep_lock);
+    if (grep_num_pending + num_hits > grep_pending_cap) {
+        while (grep_num_pending + num_hits > grep_pending_cap) {
+            grep_pending_cap = grep_pending_cap ? grep_pending_cap * 2 : 256;
+        }
+        grep_pending = realloc(grep_pending, grep_pending_cap * sizeof(char *));
+        grep_pending_path = realloc(grep_pending_path, grep_pending_cap * sizeof(int));
+    }
+    memcpy(&grep_pending[grep_num_pending], hits, num_hits * sizeof(char *));
+    for (int i = 0; i < num_hits; i++) grep_pending_path[grep_num_pending + i] = strlen(path);
+    grep_num_pending += num_hits;
+    pthread_mutex_unlock(&grep_lock);
+    free(hits);
 }
 
-void insertChar(int c) {
-    if (cy >= MAX_LINES) return;
-
-    if (lines[cy] == NULL) {
-        lines[cy] = malloc(1);
-        lines[cy][0] = '\0';
+static void *grepWorker(void *arg) {
+    (void)arg;
+    int i;
+    while ((i = atomic_fetch_add(&grep_next_file, 1)) < grep_num_files) {
+        grepFile(grep_files[i]);
+        atomic_fetch_add(&grep_files_searched, 1);
     }
+    return NULL;
+}
+
+static void *grepMain(void *arg) {
+    (void)arg;
+    grepCollect(".");
 
-    int len = strlen(lines[cy]);
-    if (cx > len) cx = len;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > 64) n = 64;
+    pthread_t workers[64];
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&workers[started], NULL, grepWorker, NULL) == 0) started++;
+    }
+    if (started == 0) grepWorker(NULL);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
 
-    lines[cy] = realloc(lines[cy], len + 2);
-    memmove(&lines[cy][cx + 1], &lines[cy][cx], len - cx + 1);
-    lines[cy][cx] = c;
-    cx++;
-    if (cy >= num_lines) num_lines = cy + 1;
+    atomic_store(&grep_done, 1);
+    return NULL;
 }
 
-void deleteChar() {
-    if (cy >= num_lines || !lines[cy]) return;
+void startGrep(const char *pattern) {
+    if (grep_running) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Grep] Still searching...");
+        return;
+    }
+    if (pattern[0] == '\0') {
+        snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+        return;
+    }
+
+    if (!grep_buf) {
+        struct Buffer *prev = B;
+        grep_buf = newBuffer("[grep]");
+        grep_buf->scratch = 1;
+        B = prev;
+    }
+    struct Buffer *prev = B;
+    B = grep_buf;
+    freeLines();
+    B->cx = B->cy = B->rowoff = 0;
+    B = prev;
+
+    snprintf(grep_pattern, sizeof(grep_pattern), "%s", pattern);
+    for (int i = 0; i < grep_num_files; i++) free(grep_files[i]);
+    grep_num_files = 0;
+    atomic_store(&grep_next_file, 0);
+    atomic_store(&grep_files_searched, 0);
+    atomic_store(&grep_done, 0);
+    if (pthread_create(&grep_thread, NULL, grepMain, NULL) != 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't grep! pthread_create error.");
+        return;
+    }
+    grep_running = 1;
+    if (!showBuffer(grep_buf)) return;
+    snprintf(statusmsg, sizeof(statusmsg), "[Grep] Searching for %.40s...", grep_pattern);
+}
 
-    if (cx > 0) {
-        int len = strlen(lines[cy]);
-        memmove(&lines[cy][cx - 1], &lines[cy][cx], len - cx + 1);
-        lines[cy] = realloc(lines[cy], len);
-        cx--;
-    } else if (cy > 0) {
-        int prev_len = strlen(lines[cy - 1]);
-        int curr_len = strlen(lines[cy]);
+// move finished hits into the results buffer, returns 1 if the screen needs a refresh
+int pollGrep() {
+    if (!grep_running) return 0;
 
-        lines[cy - 1] = realloc(lines[cy - 1], prev_len + curr_len + 1);
-        strcat(lines[cy - 1], lines[cy]);
+    int changed = 0;
+    pthread_mutex_lock(&grep_lock);
+    if (grep_num_pending > 0) {
+        struct Buffer *prev = B;
+        B = grep_buf;
+        ensureLineCapacity(B->num_lines + grep_num_pending);
+        if (B->num_lines + grep_num_pending > grep_path_cap) {
+            grep_path_cap = B->lines_cap;
+            grep_path_len = realloc(grep_path_len, grep_path_cap * sizeof(int));
+            if (!grep_path_len) die("realloc");
+        }
+        for (int i = 0; i < grep_num_pending; i++) {
+            int len = strlen(grep_pending[i]);
+            grep_path_len[B->num_lines] = grep_pending_path[i];
+            B->lines[B->num_lines] = lineAlloc(len + 1);
+            memcpy(B->lines[B->num_lines], grep_pending[i], len + 1);
+            B->num_lines++;
+            free(grep_pending[i]);
+        }
+        B = prev;
+        grep_num_pending = 0;
+        damageBuffer(grep_buf);
+        changed = 1;
+    }
+    pthread_mutex_unlock(&grep_lock);
 
-        free(lines[cy]);
-        for (int i = cy; i < num_lines - 1; i++) {
-            lines[i] = lines[i + 1];
+    if (atomic_load(&grep_done)) {
+        pthread_join(grep_thread, NULL);
+        grep_running = 0;
+        if (B == grep_buf) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Grep] %d hits in %d files, Enter to open",
+                     grep_buf->num_lines, atomic_load(&grep_files_searched));
         }
-        lines[num_lines - 1] = NULL;
-        num_lines--;
-        cy--;
-        cx = prev_len;
+        changed = 1;
     }
+    return changed;
 }
 
-void insertNewline() {
-    if (cy >= MAX_LINES - 1) return;
+void jumpToGrepResult() {
+    char *line = B->lines[B->cy];
+    if (!line) return;
 
-    char *line = lines[cy];
-    if (!line) {
-        cy++;
-        cx = 0;
-        return;
+    // results look like path:line:text; the path length was kept when the hit came in,
+    // the first colon is only a guess for a line that was edited since
+    char *colon = NULL;
+    if (B == grep_buf && B->cy < grep_path_cap) {
+        int plen = grep_path_len[B->cy];
+        if (plen < (int)strlen(line) && line[plen] == ':' && isdigit((unsigned char)line[plen + 1])) colon = line + plen;
     }
+    if (!colon) colon = strchr(line, ':');
+    if (!colon) return;
+    int line_no = atoi(colon + 1);
+    if (line_no < 1) return;
 
-    int len = strlen(line);
-    char *left = malloc(cx + 1);
-    char *right = malloc(len - cx + 1);
+    char path[4096];
+    snprintf(path, sizeof(path), "%.*s", (int)(colon - line), line);
+    struct Buffer *b = openBuffer(path);
+    if (!showBuffer(b)) return;
+    B->cy = line_no - 1 < B->num_lines ? line_no - 1 : (B->num_lines > 0 ? B->num_lines - 1 : 0);
+    B->cx = 0;
+    // center the hit
+    centerCursor();
 
-    memcpy(left, line, cx);
-    left[cx] = '\0';
-    strcpy(right, &line[cx]);
+    // highlight the pattern in the opened file, n/p step through it
+    snprintf(B->search_query, sizeof(B->search_query), "%s", grep_pattern);
+    B->search_query_len = strlen(B->search_query);
+    collectMatches();
+    B->search_mode = B->num_matches > 0 ? 2 : 0;
+    B->current_match = 0;
+    for (int i = 0; i < B->num_matches; i++) {
+        if (B->search_matches[i].y == B->cy) {
+            B->current_match = i;
+            B->cx = B->search_matches[i].x;
+            break;
+        }
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Grep] %s:%d", B->filename, line_no);
+}
 
-    lines[cy] = left;
+/*** Multiple Cursor Functions ***/
 
-    for (int i = num_lines; i > cy + 1; i--) {
-        lines[i] = lines[i - 1];
+void addCursor(int x, int y) {
+    if (x == B->cx && y == B->cy) return;
+    for (int i = 0; i < B->num_cursors; i++) {
+        if (B->cursors[i].x == x && B->cursors[i].y == y) return;
     }
+    if (B->num_cursors == B->cursors_cap) {
+        B->cursors_cap = B->cursors_cap ? B->cursors_cap * 2 : 16;
+        B->cursors = realloc(B->cursors, B->cursors_cap * sizeof(struct Cursor));
+    }
+    B->cursors[B->num_cursors++] = (struct Cursor){x, y};
+}
 
-    lines[cy + 1] = right;
-    num_lines++;
-    cy++;
-    cx = 0;
+void clearCursors() {
+    B->num_cursors = 0;
 }
 
-void toggleVisualMode() {
-    if (visual_mode) {
-        visual_mode = 0;
-        snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
-    } else {
-        visual_mode = 1;
-        sx = cx;
-        sy = cy;
-        snprintf(statusmsg, sizeof(statusmsg), "[Visual Mode]");
-    }
+// leave a cursor on the current match and move on to the next one
+void addCursorAtNextMatch() {
+    if (B->num_matches < 2) return;
+    int x = B->cx, y = B->cy;
+    findNext();
+    addCursor(x, y);
+    snprintf(statusmsg, sizeof(statusmsg), "[Multi-Cursor] %d cursors, Esc then type to edit", B->num_cursors + 1);
 }
 
-void copySelection() {
-    if (!visual_mode) return;
+void addCursorBelow() {
+    if (B->cy >= B->num_lines - 1) return;
+    int x = B->cx, y = B->cy;
+    B->cy++;
+    int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+    if (B->cx > len) B->cx = len;
+    scrollToCursor();
+    addCursor(x, y);
+    snprintf(statusmsg, sizeof(statusmsg), "[Multi-Cursor] %d cursors", B->num_cursors + 1);
+}
 
-    // free previous clipboard content
-    if (clipboard) free(clipboard);
+static int compareCursors(const void *a, const void *b) {
+    const struct Cursor *ca = a, *cb = b;
+    if (ca->y != cb->y) return ca->y < cb->y ? -1 : 1;
+    return (ca->x > cb->x) - (ca->x < cb->x);
+}
 
-    // boundarys of selection
-    int start_y = sy < cy ? sy : cy;
-    int end_y = sy < cy ? cy : sy;
-    int start_x = (sy < cy || (sy == cy && sx <= cx)) ? sx : cx;
-    int end_x = (sy < cy || (sy == cy && sx <= cx)) ? cx : sx;
+// every cursor including the primary, sorted and deduplicated; *primary is its index
+static struct Cursor *gatherCursors(int *n, int *primary) {
+    struct Cursor *all = malloc((B->num_cursors + 1) * sizeof(struct Cursor));
+    memcpy(all, B->cursors, B->num_cursors * sizeof(struct Cursor));
+    all[B->num_cursors] = (struct Cursor){B->cx, B->cy};
+    qsort(all, B->num_cursors + 1, sizeof(struct Cursor), compareCursors);
 
-    // handle same-line selection
-    if (start_y == end_y && start_x == end_x) {
-        clipboard = malloc(1);
-        clipboard[0] = '\0';
-        clip_len = 0;
-        visual_mode = 0;
-        snprintf(statusmsg, sizeof(statusmsg), "[Copied 0 chars]");
-        return;
+    int m = 0;
+    for (int i = 0; i <= B->num_cursors; i++) {
+        if (m > 0 && all[m - 1].x == all[i].x && all[m - 1].y == all[i].y) continue;
+        all[m++] = all[i];
     }
+    *n = m;
+    *primary = 0;
+    for (int i = 0; i < m; i++) {
+        if (all[i].x == B->cx && all[i].y == B->cy) *primary = i;
+    }
+    return all;
+}
 
-    // calculate total length needed
-    clip_len = 0;
-    for (int y = start_y; y <= end_y; y++) {
-        if (lines[y]) {
-            int len = strlen(lines[y]);
-            int x_start = (y == start_y) ? start_x : 0;
-            int x_end = (y == end_y) ? end_x : len;
-            clip_len += x_end - x_start;
-            if (y < end_y) clip_len++; // For newline
+// store the adjusted positions back, the primary keeps cx/cy; cursors an edit
+// stacked onto the same spot collapse into one
+static void scatterCursors(struct Cursor *all, int n, int primary) {
+    B->cx = all[primary].x;
+    B->cy = all[primary].y;
+    B->num_cursors = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == primary || (all[i].x == B->cx && all[i].y == B->cy)) continue;
+        if (B->num_cursors > 0 && compareCursors(&B->cursors[B->num_cursors - 1], &all[i]) == 0) continue;
+        B->cursors[B->num_cursors++] = all[i];
+    }
+    free(all);
+    B->dirty = 1;
+    wordsStale(B);
+    scrollToCursor();
+}
+
+// one rebuild per affected line, however many cursors sit on it
+void multiInsertChar(int c) {
+    int n, primary;
+    struct Cursor *all = gatherCursors(&n, &primary);
+
+    for (int i = 0; i < n;) {
+        int y = all[i].y;
+        int j = i;
+        while (j < n && all[j].y == y) j++;
+
+        ensureLineCapacity(y + 1);
+        char *line = B->lines[y] ? B->lines[y] : "";
+        int len = strlen(line);
+        char *out = lineAlloc(len + (j - i) + 1);
+        int pos = 0, dst = 0;
+        for (int k = i; k < j; k++) {
+            int x = all[k].x < len ? all[k].x : len;
+            memcpy(&out[dst], &line[pos], x - pos);
+            dst += x - pos;
+            out[dst++] = c;
+            pos = x;
+            all[k].x = dst;
         }
+        memcpy(&out[dst], &line[pos], len - pos + 1);
+        lineFree(B->lines[y]);
+        B->lines[y] = out;
+        if (y >= B->num_lines) B->num_lines = y + 1;
+        lineChanged(B, y);
+        i = j;
     }
+    scatterCursors(all, n, primary);
+}
 
-    // allocate and copy to clipboard
-    clipboard = malloc(clip_len + 1);
-    int pos = 0;
-    for (int y = start_y; y <= end_y; y++) {
-        if (lines[y]) {
-            int len = strlen(lines[y]);
-            int x_start = (y == start_y) ? start_x : 0;
-            int x_end = (y == end_y) ? end_x : len;
-            for (int x = x_start; x < x_end; x++) {
-                clipboard[pos++] = lines[y][x];
+// backspace at every cursor, cursors at the start of a line stay put
+void multiDeleteChar() {
+    int n, primary;
+    struct Cursor *all = gatherCursors(&n, &primary);
+
+    for (int i = 0; i < n;) {
+        int y = all[i].y;
+        int j = i;
+        while (j < n && all[j].y == y) j++;
+
+        char *line = y < B->num_lines ? B->lines[y] : NULL;
+        if (line) {
+            // compact in place, the write position never passes the read position
+            int len = strlen(line);
+            int pos = 0, dst = 0;
+            for (int k = i; k < j; k++) {
+                int x = all[k].x < len ? all[k].x : len;
+                if (x == 0) {
+                    all[k].x = 0;
+                    continue;
+                }
+                memmove(&line[dst], &line[pos], x - 1 - pos);
+                dst += x - 1 - pos;
+                pos = x;
+                all[k].x = dst;
             }
-            if (y < end_y && pos < clip_len) clipboard[pos++] = '\n';
+            memmove(&line[dst], &line[pos], len - pos + 1);
+            lineChanged(B, y);
         }
+        i = j;
     }
-    clipboard[pos] = '\0';
-    clip_len = pos;
-
-    // exit visual mode
-    visual_mode = 0;
-    snprintf(statusmsg, sizeof(statusmsg), "[Copied %d chars]", clip_len);
+    scatterCursors(all, n, primary);
 }
 
-void cutSelection() {
-    if (!visual_mode) return;
-
-    // copy selection to clipboard first
-    copySelection();
+// split every line at its cursors, rebuilding the line array once
+void multiInsertNewline() {
+    int n, primary;
+    struct Cursor *all = gatherCursors(&n, &primary);
 
-    // determine selection boundaries
-    int start_y = sy < cy ? sy : cy;
-    int end_y = sy < cy ? cy : sy;
-    int start_x = (sy < cy || (sy == cy && sx <= cx)) ? sx : cx;
-    int end_x = (sy < cy || (sy == cy && sx <= cx)) ? cx : sx;
+    // marks below each split line move down by its cursor count, bottom up so lines above keep their place
+    for (int k = n - 1; k >= 0;) {
+        int y = all[k].y, count = 0;
+        for (; k >= 0 && all[k].y == y; k--) count++;
+        shiftMarks(B, y + 1, count);
+    }
 
-    // handle same-line selection
+    int new_cap = B->lines_cap > B->num_lines + n + 1 ? B->lines_cap : B->num_lines + n + 1;
+    char **out = calloc(new_cap, sizeof(char *));
+    int *from = malloc(new_cap * sizeof(int)); // old line of each new one, -1 for split pieces
+    if (!out || !from) die("calloc");
+    int dst = 0;
+    int k = 0;
+    for (int y = 0; y < B->num_lines || (k < n && all[k].y == y); y++) {
+        char *line = y < B->num_lines && B->lines[y] ? B->lines[y] : NULL;
+        if (k >= n || all[k].y != y) {
+            from[dst] = y < B->num_lines ? y : -1;
+            out[dst++] = line;
+            continue;
+        }
+        int len = line ? strlen(line) : 0;
+        int pos = 0;
+        for (; k < n && all[k].y == y; k++) {
+            int x = all[k].x < len ? all[k].x : len;
+            char *piece = lineAlloc(x - pos + 1);
+            memcpy(piece, &line[pos], x - pos);
+            piece[x - pos] = '\0';
+            from[dst] = -1;
+            out[dst++] = piece;
+            pos = x;
+            all[k].x = 0;
+            all[k].y = dst;
+        }
+        char *rest = lineAlloc(len - pos + 1);
+        memcpy(rest, line ? &line[pos] : "", len - pos);
+        rest[len - pos] = '\0';
+        from[dst] = -1;
+        out[dst++] = rest;
+        lineFree(line);
+    }
+    free(B->lines);
+    B->lines = out;
+    B->lines_cap = new_cap;
+    B->num_lines = dst;
+    linesRemapped(B, from, dst);
+    free(from);
+    if (B->filter_on) buildFilter(B);
+    clearFolds(B);
+    scatterCursors(all, n, primary);
+}
+
+/*** Line Index Functions ***/
+
+static void addStats(struct LineStats *a, struct LineStats d, int sign) {
+    a->bytes += sign * d.bytes;
+    a->words += sign * d.words;
+    a->chars += sign * d.chars;
+}
+
+// counts for line a .. end - 1, words cut by either end count as words
+static struct LineStats countStats(const char *line, int a, int end) {
+    struct LineStats st = {end - a, 0, 0};
+    int in_word = 0;
+    for (int i = a; i < end; i++) {
+        unsigned char c = line[i];
+        st.chars += (c & 0xC0) != 0x80;
+        if (isspace(c)) {
+            in_word = 0;
+        } else if (!in_word) {
+            in_word = 1;
+            st.words++;
+        }
+    }
+    return st;
+}
+
+// counts for a .. end widened to whole words, so the words an edit there touches are all inside
+struct LineStats spanStats(const char *line, int a, int end) {
+    if (!line) return (struct LineStats){0, 0, 0};
+    while (a > 0 && !isspace((unsigned char)line[a - 1])) a--;
+    while (line[end] && !isspace((unsigned char)line[end])) end++;
+    return countStats(line, a, end);
+}
+
+static struct LineStats lineStats(struct Buffer *b, int y) {
+    const char *line = b->lines[y];
+    if (!line) return (struct LineStats){0, 0, 0};
+    struct LineStats st = countStats(line, 0, strlen(line));
+    st.bytes++;
+    st.chars++;
+    return st;
+}
+
+static struct StatsBlock *newStatsBlock() {
+    struct StatsBlock *k = calloc(1, sizeof(struct StatsBlock));
+    if (!k) die("calloc");
+    return k;
+}
+
+// swap count blocks at index at for n others; one empty block is kept when none are left
+static void spliceStatsBlocks(struct Buffer *b, int at, int count, struct StatsBlock **add, int n) {
+    for (int i = at; i < at + count; i++) free(b->stats_blocks[i]);
+    int total = b->stats_nblocks - count + n;
+    if (total + 1 > b->stats_blocks_cap) {
+        b->stats_blocks_cap = total + 1 > 2 * b->stats_blocks_cap ? total + 1 : 2 * b->stats_blocks_cap;
+        b->stats_blocks = realloc(b->stats_blocks, b->stats_blocks_cap * sizeof(struct StatsBlock *));
+        if (!b->stats_blocks) die("realloc");
+    }
+    memmove(&b->stats_blocks[at + n], &b->stats_blocks[at + count],
+            (b->stats_nblocks - at - count) * sizeof(struct StatsBlock *));
+    if (n) memcpy(&b->stats_blocks[at], add, n * sizeof(struct StatsBlock *));
+    b->stats_nblocks = total;
+    if (total == 0) b->stats_blocks[b->stats_nblocks++] = newStatsBlock();
+    b->stats_dirty = 1;
+}
+
+// make blocks holding st[0 .. n - 1] and put them at block index at
+static int insertStatsBlocks(struct Buffer *b, int at, const struct LineStats *st, int n) {
+    int count = (n + STATS_FILL - 1) / STATS_FILL;
+    struct StatsBlock **add = malloc((count + 1) * sizeof(struct StatsBlock *));
+    if (!add) die("malloc");
+    for (int i = 0; i < count; i++) {
+        add[i] = newStatsBlock();
+        add[i]->n = n - i * STATS_FILL < STATS_FILL ? n - i * STATS_FILL : STATS_FILL;
+        memcpy(add[i]->line, &st[i * STATS_FILL], add[i]->n * sizeof(struct LineStats));
+        for (int j = 0; j < add[i]->n; j++) addStats(&add[i]->sum, add[i]->line[j], 1);
+    }
+    spliceStatsBlocks(b, at, 0, add, count);
+    free(add);
+    return count;
+}
+
+// rebuild both trees from the block sums, O(blocks)
+static void statsTrees(struct Buffer *b) {
+    if (!b->stats_dirty) return;
+    int n = b->stats_nblocks;
+    b->stats_tree = realloc(b->stats_tree, (n + 1) * sizeof(struct LineStats));
+    b->stats_lines = realloc(b->stats_lines, (n + 1) * sizeof(int));
+    if (!b->stats_tree || !b->stats_lines) die("realloc");
+    for (int i = 1; i <= n; i++) {
+        b->stats_tree[i] = b->stats_blocks[i - 1]->sum;
+        b->stats_lines[i] = b->stats_blocks[i - 1]->n;
+    }
+    for (int i = 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j > n) continue;
+        addStats(&b->stats_tree[j], b->stats_tree[i], 1);
+        b->stats_lines[j] += b->stats_lines[i];
+    }
+    b->stats_dirty = 0;
+}
+
+// block holding line *y, with *y turned into the line's place in it; the line count maps to
+// the end of the last block
+static int findStatsBlock(struct Buffer *b, int *y) {
+    statsTrees(b);
+    int pos = 0, step = 1;
+    while (step * 2 <= b->stats_nblocks) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= b->stats_nblocks && b->stats_lines[pos + step] <= *y) {
+            pos += step;
+            *y -= b->stats_lines[pos];
+        }
+    }
+    if (pos == b->stats_nblocks) {
+        pos--;
+        *y += b->stats_blocks[pos]->n;
+    }
+    return pos;
+}
+
+static struct LineStats *statsLine(struct Buffer *b, int y) {
+    int k = findStatsBlock(b, &y);
+    return &b->stats_blocks[k]->line[y];
+}
+
+// add d to the counts of line y
+static void statsAdd(struct Buffer *b, int y, struct LineStats d) {
+    int k = findStatsBlock(b, &y);
+    addStats(&b->stats_blocks[k]->line[y], d, 1);
+    addStats(&b->stats_blocks[k]->sum, d, 1);
+    for (int i = k + 1; i <= b->stats_nblocks; i += i & -i) addStats(&b->stats_tree[i], d, 1);
+}
+
+// make line y start a block, returns that block's index
+static int splitStatsBlock(struct Buffer *b, int y) {
+    int k = findStatsBlock(b, &y);
+    struct StatsBlock *s = b->stats_blocks[k];
+    if (y == 0) return k;
+    if (y == s->n) return k + 1;
+    struct StatsBlock *t = newStatsBlock();
+    t->n = s->n - y;
+    memcpy(t->line, &s->line[y], t->n * sizeof(struct LineStats));
+    for (int i = 0; i < t->n; i++) addStats(&t->sum, t->line[i], 1);
+    addStats(&s->sum, t->sum, -1);
+    s->n = y;
+    spliceStatsBlocks(b, k + 1, 0, &t, 1);
+    return k + 1;
+}
+
+// fold block k + 1 into block k when they fit in one, so edits don't leave a trail of small blocks
+static void mergeStatsBlocks(struct Buffer *b, int k) {
+    if (k < 0 || k + 1 >= b->stats_nblocks) return;
+    struct StatsBlock *s = b->stats_blocks[k], *t = b->stats_blocks[k + 1];
+    if (s->n && t->n && s->n + t->n > STATS_FILL) return;
+    memcpy(&s->line[s->n], t->line, t->n * sizeof(struct LineStats));
+    s->n += t->n;
+    addStats(&s->sum, t->sum, 1);
+    spliceStatsBlocks(b, k + 1, 1, NULL, 0);
+}
+
+// count lines at first now hold n counted afresh; an edit inside one block shifts that block,
+// anything larger cuts the blocks at both ends and swaps whole ones
+static void replaceStats(struct Buffer *b, int first, int count, int n) {
+    int y = first;
+    int k = findStatsBlock(b, &y);
+    struct StatsBlock *s = b->stats_blocks[k];
+    if (y + count <= s->n && s->n - count + n <= STATS_BLOCK) {
+        struct LineStats d = {0, 0, 0};
+        for (int i = y; i < y + count; i++) addStats(&d, s->line[i], -1);
+        memmove(&s->line[y + n], &s->line[y + count], (s->n - y - count) * sizeof(struct LineStats));
+        for (int i = 0; i < n; i++) {
+            s->line[y + i] = lineStats(b, first + i);
+            addStats(&d, s->line[y + i], 1);
+        }
+        s->n += n - count;
+        addStats(&s->sum, d, 1);
+        for (int i = k + 1; i <= b->stats_nblocks; i += i & -i) {
+            addStats(&b->stats_tree[i], d, 1);
+            b->stats_lines[i] += n - count;
+        }
+        mergeStatsBlocks(b, k);
+        mergeStatsBlocks(b, k - 1);
+        return;
+    }
+
+    int from = splitStatsBlock(b, first);
+    int to = splitStatsBlock(b, first + count);
+    spliceStatsBlocks(b, from, to - from, NULL, 0);
+    struct LineStats *st = malloc((n + 1) * sizeof(struct LineStats));
+    if (!st) die("malloc");
+    for (int i = 0; i < n; i++) st[i] = lineStats(b, first + i);
+    int added = insertStatsBlocks(b, from, st, n);
+    free(st);
+    mergeStatsBlocks(b, from + added - 1);
+    mergeStatsBlocks(b, from - 1);
+}
+
+// replace every block with ones holding st
+static void resetStats(struct Buffer *b, const struct LineStats *st, int n) {
+    spliceStatsBlocks(b, 0, b->stats_nblocks, NULL, 0);
+    if (insertStatsBlocks(b, 0, st, n) > 0) spliceStatsBlocks(b, b->stats_nblocks - 1, 1, NULL, 0);
+    b->stats_n = n;
+}
+
+// recount everything, only needed after a path that did not report its edit
+static void statsSync(struct Buffer *b) {
+    if (b->stats_n == b->num_lines) return;
+    struct LineStats *st = malloc((b->num_lines + 1) * sizeof(struct LineStats));
+    if (!st) die("malloc");
+    for (int i = 0; i < b->num_lines; i++) st[i] = lineStats(b, i);
+    resetStats(b, st, b->num_lines);
+    free(st);
+}
+
+static struct LineStats statsPrefix(struct Buffer *b, int n) {
+    if (n > b->stats_n) n = b->stats_n;
+    int k = findStatsBlock(b, &n);
+    struct LineStats sum = {0, 0, 0};
+    for (int i = k; i > 0; i -= i & -i) addStats(&sum, b->stats_tree[i], 1);
+    // read whichever end of the block is shorter
+    struct StatsBlock *s = b->stats_blocks[k];
+    if (n <= s->n / 2) {
+        for (int i = 0; i < n; i++) addStats(&sum, s->line[i], 1);
+    } else {
+        addStats(&sum, s->sum, 1);
+        for (int i = n; i < s->n; i++) addStats(&sum, s->line[i], -1);
+    }
+    return sum;
+}
+
+// line y changed from before to after, both taken with spanStats over the edited span
+void lineEdited(struct Buffer *b, int y, struct LineStats before, struct LineStats after) {
+    csvChanged(b, y);
+    b->block_stats_valid = 0;
+    if (b->stats_n != b->num_lines) return;
+    addStats(&after, before, -1);
+    statsAdd(b, y, after);
+}
+
+// the last line is new
+void lineAppended(struct Buffer *b) {
+    int i = b->num_lines;
+    bracketsReplaced(b, i - 1, 0, 1);
+    csvReplaced(b, i - 1, 0, 1);
+    b->block_stats_valid = 0;
+    if (b->stats_n != i - 1) return;
+    replaceStats(b, i - 1, 0, 1);
+    b->stats_n = i;
+}
+
+// line y was rewritten, recount it in place
+void lineChanged(struct Buffer *b, int y) {
+    bracketsChanged(b, y);
+    csvChanged(b, y);
+    b->block_stats_valid = 0;
+    if (b->stats_n != b->num_lines || y >= b->stats_n) return;
+    struct LineStats d = lineStats(b, y);
+    addStats(&d, *statsLine(b, y), -1);
+    statsAdd(b, y, d);
+}
+
+// count lines at first were replaced by n new ones
+void linesReplaced(struct Buffer *b, int first, int count, int n) {
+    bracketsReplaced(b, first, count, n);
+    csvReplaced(b, first, count, n);
+    wordsReplaced(b, first, count, n);
+    b->block_stats_valid = 0;
+    if (b->stats_n != b->num_lines - n + count) return;
+    replaceStats(b, first, count, n);
+    b->stats_n = b->num_lines;
+}
+
+// line i now holds old line from[i], or a new line when from[i] is -1
+void linesRemapped(struct Buffer *b, const int *from, int n) {
+    bracketsRemapped(b, from, n);
+    csvRemapped(b, from, n);
+    wordsMoved(b);
+    b->block_stats_valid = 0;
+    int valid = b->stats_n;
+    struct LineStats *old = malloc((valid > 0 ? valid : 0) * sizeof(struct LineStats) + 1);
+    struct LineStats *st = malloc((n + 1) * sizeof(struct LineStats));
+    if (!old || !st) die("malloc");
+    for (int k = 0, y = 0; k < b->stats_nblocks && y < valid; k++) {
+        memcpy(&old[y], b->stats_blocks[k]->line, b->stats_blocks[k]->n * sizeof(struct LineStats));
+        y += b->stats_blocks[k]->n;
+    }
+    for (int i = 0; i < n; i++) st[i] = from[i] >= 0 && from[i] < valid ? old[from[i]] : lineStats(b, i);
+    resetStats(b, st, n);
+    free(old);
+    free(st);
+}
+
+void statsInvalidate(struct Buffer *b) {
+    b->stats_n = -1;
+    b->bracket_n = -1;
+    b->csv_n = -1;
+    b->block_stats_valid = 0;
+    wordsMoved(b);
+}
+
+// totals for lines first .. last
+struct LineStats bufferStats(struct Buffer *b, int first, int last) {
+    statsSync(b);
+    struct LineStats st = statsPrefix(b, last + 1);
+    addStats(&st, statsPrefix(b, first), -1);
+    return st;
+}
+
+// counts of columns left .. right - 1 of lines top .. bottom
+static struct LineStats blockRows(int top, int bottom, int left, int right) {
+    struct LineStats st = {0, 0, 0};
+    for (int y = top; y <= bottom; y++) {
+        int len = B->lines[y] ? strlen(B->lines[y]) : 0;
+        if (len > left) addStats(&st, countStats(B->lines[y], left, len < right ? len : right), 1);
+    }
+    return st;
+}
+
+// totals for the visual selection; partial first and last lines are the only text read
+struct LineStats selectionStats(int *lines) {
+    struct LineStats st = {0, 0, 0};
+    if (visual_mode == 2) {
+        int top, bottom, left, right;
+        blockBounds(&top, &bottom, &left, &right);
+        if (bottom >= B->num_lines) bottom = B->num_lines - 1;
+        *lines = bottom - top + 1;
+        // counted once per cursor move; a move that keeps the columns only reads the rows it adds or drops
+        int *r = B->block_rect;
+        if (!B->block_stats_valid || left != r[2] || right != r[3] || top > r[1] || bottom < r[0]) {
+            B->block_stats = blockRows(top, bottom, left, right);
+        } else {
+            if (top < r[0]) addStats(&B->block_stats, blockRows(top, r[0] - 1, left, right), 1);
+            if (top > r[0]) addStats(&B->block_stats, blockRows(r[0], top - 1, left, right), -1);
+            if (bottom > r[1]) addStats(&B->block_stats, blockRows(r[1] + 1, bottom, left, right), 1);
+            if (bottom < r[1]) addStats(&B->block_stats, blockRows(bottom + 1, r[1], left, right), -1);
+        }
+        r[0] = top, r[1] = bottom, r[2] = left, r[3] = right;
+        B->block_stats_valid = 1;
+        return B->block_stats;
+    }
+
+    int start_y = sy < B->cy ? sy : B->cy;
+    int end_y = sy < B->cy ? B->cy : sy;
+    int start_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? sx : B->cx;
+    int end_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? B->cx : sx;
+    *lines = end_y - start_y + 1;
+    if (end_y >= B->num_lines) return st;
+    const char *first = B->lines[start_y], *last = B->lines[end_y];
+    if (start_y == end_y) return first ? countStats(first, start_x, end_x) : st;
+
+    if (first) {
+        st = countStats(first, start_x, strlen(first));
+        st.bytes++;
+        st.chars++;
+    }
+    if (end_y > start_y + 1) addStats(&st, bufferStats(B, start_y + 1, end_y - 1), 1);
+    if (last) addStats(&st, countStats(last, 0, end_x), 1);
+    return st;
+}
+
+// bytes before line in the saved file
+long long lineOffset(struct Buffer *b, int line) {
+    statsSync(b);
+    return statsPrefix(b, line).bytes;
+}
+
+// line holding byte off, with the byte's column in *col
+int lineAtOffset(struct Buffer *b, long long off, long long *col) {
+    statsSync(b);
+    statsTrees(b);
+    int k = 0, pos = 0, step = 1;
+    while (step * 2 <= b->stats_nblocks) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (k + step <= b->stats_nblocks && b->stats_tree[k + step].bytes <= off) {
+            k += step;
+            off -= b->stats_tree[k].bytes;
+            pos += b->stats_lines[k];
+        }
+    }
+    if (k < b->stats_nblocks) {
+        struct StatsBlock *s = b->stats_blocks[k];
+        for (int i = 0; i < s->n && s->line[i].bytes <= off; i++, pos++) off -= s->line[i].bytes;
+    }
+    if (pos >= b->num_lines) {
+        pos = b->num_lines > 0 ? b->num_lines - 1 : 0;
+        off = 0;
+    }
+    *col = off;
+    return pos;
+}
+
+void gotoLine(int line) {
+    if (line >= B->num_lines) line = B->num_lines - 1;
+    if (line < 0) line = 0;
+    B->cy = line;
+    B->cx = 0;
+    revealLine(line);
+    centerCursor();
+    snprintf(statusmsg, sizeof(statusmsg), "[Goto] Line %d of %d", line + 1, B->num_lines);
+}
+
+void gotoPercent(int pct) {
+    if (pct > 100) pct = 100;
+    gotoLine((int)(((long long)pct * B->num_lines + 99) / 100) - 1);
+}
+
+void gotoByte(long long off) {
+    long long col;
+    int line = lineAtOffset(B, off < 0 ? 0 : off, &col);
+    gotoLine(line);
+    int len = B->lines[line] ? strlen(B->lines[line]) : 0;
+    B->cx = col < len ? col : len;
+    snprintf(statusmsg, sizeof(statusmsg), "[Goto] Byte %lld is line %d, column %d", off + 1, line + 1, B->cx + 1);
+}
+
+/*** Bracket Functions ***/
+
+static int bracketValue(char c) {
+    switch (c) {
+    case '(': case '[': case '{': return 1;
+    case ')': case ']': case '}': return -1;
+    }
+    return 0;
+}
+
+static struct BracketSum joinBrackets(struct BracketSum a, struct BracketSum b) {
+    struct BracketSum s;
+    s.net = a.net + b.net;
+    s.minpre = a.minpre < a.net + b.minpre ? a.minpre : a.net + b.minpre;
+    s.maxsuf = b.maxsuf > b.net + a.maxsuf ? b.maxsuf : b.net + a.maxsuf;
+    return s;
+}
+
+static struct BracketSum lineBrackets(const char *line) {
+    struct BracketSum s = {0, 0, 0};
+    if (!line) return s;
+    for (const char *c = line; (c = strpbrk(c, "()[]{}")); c++) {
+        s.net += bracketValue(*c);
+        if (s.net < s.minpre) s.minpre = s.net;
+    }
+    // the best suffix ends at the line end, so it is net minus the lowest prefix
+    s.maxsuf = s.net - s.minpre;
+    return s;
+}
+
+static void reserveBrackets(struct Buffer *b, int n) {
+    if (n + 1 <= b->bracket_cap) return;
+    b->bracket_cap = n + 1 > 2 * b->bracket_cap ? n + 1 : 2 * b->bracket_cap;
+    b->bracket_lines = realloc(b->bracket_lines, b->bracket_cap * sizeof(struct BracketSum));
+    if (!b->bracket_lines) die("realloc");
+}
+
+// rescan the lines marked unknown and rebuild the tree from the cache
+static void bracketSync(struct Buffer *b) {
+    if (b->bracket_n != b->num_lines) {
+        reserveBrackets(b, b->num_lines);
+        for (int i = 0; i < b->num_lines; i++) b->bracket_lines[i].maxsuf = -1;
+        b->bracket_n = b->num_lines;
+        b->bracket_dirty = 1;
+    }
+    if (!b->bracket_dirty) return;
+    int n = b->bracket_n, size = 1;
+    while (size < n) size *= 2;
+    if (size != b->bracket_size || !b->bracket_tree) {
+        b->bracket_size = size;
+        free(b->bracket_tree);
+        b->bracket_tree = malloc(2 * size * sizeof(struct BracketSum));
+        if (!b->bracket_tree) die("malloc");
+    }
+    for (int i = 0; i < size; i++) {
+        if (i < n && b->bracket_lines[i].maxsuf < 0) b->bracket_lines[i] = lineBrackets(b->lines[i]);
+        b->bracket_tree[size + i] = i < n ? b->bracket_lines[i] : (struct BracketSum){0, 0, 0};
+    }
+    for (int i = size - 1; i > 0; i--) b->bracket_tree[i] = joinBrackets(b->bracket_tree[2 * i], b->bracket_tree[2 * i + 1]);
+    b->bracket_dirty = 0;
+}
+
+// brackets on line y changed; rescan it now and fix its path up the tree
+void bracketsChanged(struct Buffer *b, int y) {
+    if (!b->bracket_lines || b->bracket_n != b->num_lines || y >= b->bracket_n) return;
+    b->bracket_lines[y] = lineBrackets(b->lines[y]);
+    if (b->bracket_dirty) return;
+    int i = b->bracket_size + y;
+    b->bracket_tree[i] = b->bracket_lines[y];
+    for (i /= 2; i > 0; i /= 2) b->bracket_tree[i] = joinBrackets(b->bracket_tree[2 * i], b->bracket_tree[2 * i + 1]);
+}
+
+// count lines at first were replaced by n new ones
+void bracketsReplaced(struct Buffer *b, int first, int count, int n) {
+    if (!b->bracket_lines || b->bracket_n != b->num_lines - n + count) return;
+    reserveBrackets(b, b->num_lines);
+    memmove(&b->bracket_lines[first + n], &b->bracket_lines[first + count],
+            (b->bracket_n - first - count) * sizeof(struct BracketSum));
+    for (int i = first; i < first + n; i++) b->bracket_lines[i].maxsuf = -1;
+    b->bracket_n = b->num_lines;
+    b->bracket_dirty = 1;
+}
+
+// line i now holds old line from[i], or a new line when from[i] is -1
+void bracketsRemapped(struct Buffer *b, const int *from, int n) {
+    if (!b->bracket_lines) return;
+    struct BracketSum *old = b->bracket_lines;
+    int valid = b->bracket_n;
+    b->bracket_lines = NULL;
+    b->bracket_cap = 0;
+    reserveBrackets(b, n);
+    for (int i = 0; i < n; i++) {
+        b->bracket_lines[i] = from[i] >= 0 && from[i] < valid ? old[from[i]] : (struct BracketSum){0, 0, -1};
+    }
+    free(old);
+    b->bracket_n = n;
+    b->bracket_dirty = 1;
+}
+
+// first line from lo on where the depth, starting at *depth, falls to 0
+static int bracketForward(struct Buffer *b, int node, int nl, int nr, int lo, int *depth) {
+    if (nr <= lo) return -1;
+    struct BracketSum *s = &b->bracket_tree[node];
+    if (nl >= lo && *depth + s->minpre > 0) {
+        *depth += s->net;
+        return -1;
+    }
+    if (nr - nl == 1) return nl;
+    int mid = (nl + nr) / 2;
+    int found = bracketForward(b, 2 * node, nl, mid, lo, depth);
+    return found >= 0 ? found : bracketForward(b, 2 * node + 1, mid, nr, lo, depth);
+}
+
+// last line before hi where the depth, walking back from *depth, falls to 0
+static int bracketBackward(struct Buffer *b, int node, int nl, int nr, int hi, int *depth) {
+    if (nl >= hi) return -1;
+    struct BracketSum *s = &b->bracket_tree[node];
+    if (nr <= hi && *depth - s->maxsuf > 0) {
+        *depth -= s->net;
+        return -1;
+    }
+    if (nr - nl == 1) return nl;
+    int mid = (nl + nr) / 2;
+    int found = bracketBackward(b, 2 * node + 1, mid, nr, hi, depth);
+    return found >= 0 ? found : bracketBackward(b, 2 * node, nl, mid, hi, depth);
+}
+
+// partner of the bracket at y, x; returns 0 if there is none or it is of another kind
+int findBracket(struct Buffer *b, int y, int x, struct Cursor *partner) {
+    const char *line = b->lines[y];
+    int dir = bracketValue(line[x]);
+    if (!dir) return 0;
+    if (!b->bracket_lines) b->bracket_n = -1;
+    bracketSync(b);
+
+    // the rest of this line first, then the tree finds the line that closes it
+    int depth = 1, len = strlen(line), py = y, px = -1;
+    for (int i = x + dir; i >= 0 && i < len; i += dir) {
+        depth += bracketValue(line[i]) * dir;
+        if (depth == 0) {
+            px = i;
+            break;
+        }
+    }
+    if (px < 0) {
+        py = dir > 0 ? bracketForward(b, 1, 0, b->bracket_size, y + 1, &depth)
+                     : bracketBackward(b, 1, 0, b->bracket_size, y, &depth);
+        if (py < 0 || py >= b->num_lines) return 0;
+        line = b->lines[py];
+        len = strlen(line);
+        for (int i = dir > 0 ? 0 : len - 1; i >= 0 && i < len; i += dir) {
+            depth += bracketValue(line[i]) * dir;
+            if (depth == 0) {
+                px = i;
+                break;
+            }
+        }
+        if (px < 0) return 0;
+    }
+    const char *pairs = "()[]{}";
+    int kind = (strchr(pairs, b->lines[y][x]) - pairs) / 2;
+    if ((strchr(pairs, line[px]) - pairs) / 2 != kind) return 0;
+    *partner = (struct Cursor){px, py};
+    return 1;
+}
+
+void updateBracketHighlight() {
+    bracket_hl_on = 0;
+    if (visual_mode || B->search_mode || diff_view || B->cy >= B->num_lines || !B->lines[B->cy]) return;
+    const char *line = B->lines[B->cy];
+    if (B->cx >= (int)strlen(line) || !bracketValue(line[B->cx])) return;
+    bracket_hl[0] = (struct Cursor){B->cx, B->cy};
+    bracket_hl_on = findBracket(B, B->cy, B->cx, &bracket_hl[1]);
+}
+
+// jump to the partner of the bracket under the cursor or the next one on the line
+void jumpToBracket() {
+    if (B->cy >= B->num_lines || !B->lines[B->cy]) return;
+    const char *line = B->lines[B->cy];
+    const char *c = B->cx < (int)strlen(line) ? strpbrk(line + B->cx, "()[]{}") : NULL;
+    struct Cursor partner;
+    if (!c || !findBracket(B, B->cy, c - line, &partner)) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Bracket] No matching bracket");
+        return;
+    }
+    B->cy = partner.y;
+    B->cx = partner.x;
+    revealLine(B->cy);
+    scrollToCursor();
+    snprintf(statusmsg, sizeof(statusmsg), "[Bracket] Line %d", B->cy + 1);
+}
+
+/*** Column Functions ***/
+
+static int *pushCell(int *t, int *cap, int start) {
+    if (t[0] + 2 > *cap) {
+        *cap *= 2;
+        t = realloc(t, *cap * sizeof(int));
+        if (!t) die("realloc");
+    }
+    t[++t[0]] = start;
+    return t;
+}
+
+// field starts of a line, delimiters inside "quotes" do not count;
+// t[0] is the number of fields and field k is line[t[1 + k] .. t[2 + k] - 1)
+static int *scanCells(const char *line, char delim) {
+    int len = line ? strlen(line) : 0;
+    int cap = 16;
+    int *t = malloc(cap * sizeof(int));
+    if (!t) die("malloc");
+    t[0] = 0;
+    t = pushCell(t, &cap, 0);
+    int quoted = 0, i = 0;
+#ifdef __SSE2__
+    // 16 bytes at a time, only the delimiters and quotes found are looked at one by one
+    __m128i d = _mm_set1_epi8(delim), q = _mm_set1_epi8('"');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, q)));
+        while (mask) {
+            int k = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (line[k] == '"') quoted = !quoted;
+            else if (!quoted) t = pushCell(t, &cap, k + 1);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (line[i] == '"') quoted = !quoted;
+        else if (line[i] == delim && !quoted) t = pushCell(t, &cap, i + 1);
+    }
+    // the end of the last field, as if a delimiter followed it
+    t = pushCell(t, &cap, len + 1);
+    t[0]--;
+    return t;
+}
+
+static void csvReset(struct Buffer *b) {
+    for (int i = 0; i < b->csv_cap; i++) {
+        free(b->csv_cells[i]);
+        b->csv_cells[i] = NULL;
+    }
+    if (b->num_lines > b->csv_cap) {
+        b->csv_cells = realloc(b->csv_cells, b->num_lines * sizeof(int *));
+        if (!b->csv_cells) die("realloc");
+        memset(&b->csv_cells[b->csv_cap], 0, (b->num_lines - b->csv_cap) * sizeof(int *));
+        b->csv_cap = b->num_lines;
+    }
+    b->csv_n = b->num_lines;
+}
+
+// the field table of line y, scanned the first time it is asked for
+int *csvCells(struct Buffer *b, int y) {
+    if (b->csv_n != b->num_lines) csvReset(b);
+    if (!b->csv_cells[y]) b->csv_cells[y] = scanCells(b->lines[y], b->csv_delim);
+    return b->csv_cells[y];
+}
+
+void csvChanged(struct Buffer *b, int y) {
+    if (b->csv_n != b->num_lines || y >= b->csv_n) return;
+    free(b->csv_cells[y]);
+    b->csv_cells[y] = NULL;
+}
+
+void csvReplaced(struct Buffer *b, int first, int count, int n) {
+    if (b->csv_n != b->num_lines - n + count) return;
+    for (int i = first; i < first + count; i++) free(b->csv_cells[i]);
+    if (b->num_lines > b->csv_cap) {
+        int cap = b->csv_cap ? b->csv_cap : 64;
+        while (cap < b->num_lines) cap *= 2;
+        b->csv_cells = realloc(b->csv_cells, cap * sizeof(int *));
+        if (!b->csv_cells) die("realloc");
+        memset(&b->csv_cells[b->csv_cap], 0, (cap - b->csv_cap) * sizeof(int *));
+        b->csv_cap = cap;
+    }
+    memmove(&b->csv_cells[first + n], &b->csv_cells[first + count], (b->csv_n - first - count) * sizeof(int *));
+    for (int i = first; i < first + n; i++) b->csv_cells[i] = NULL;
+    for (int i = b->num_lines; i < b->csv_n; i++) b->csv_cells[i] = NULL;
+    b->csv_n = b->num_lines;
+}
+
+void csvRemapped(struct Buffer *b, const int *from, int n) {
+    if (b->csv_n < 0 || !b->csv_cells) return;
+    int **old = b->csv_cells;
+    int valid = b->csv_n;
+    b->csv_cells = calloc(n > 0 ? n : 1, sizeof(int *));
+    if (!b->csv_cells) die("calloc");
+    for (int i = 0; i < n; i++) {
+        if (from[i] >= 0 && from[i] < valid) {
+            b->csv_cells[i] = old[from[i]];
+            old[from[i]] = NULL;
+        }
+    }
+    for (int i = 0; i < b->csv_cap; i++) free(old[i]);
+    free(old);
+    b->csv_cap = n > 0 ? n : 1;
+    b->csv_n = n;
+}
+
+// :csv [delimiter] turns the column view on or off, tab is the default for a line holding one
+void toggleColumnView(const char *arg) {
+    while (*arg == ' ') arg++;
+    if (B->csv_delim && !*arg) {
+        B->csv_delim = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Column] Off");
+        return;
+    }
+    char delim = *arg;
+    if (!delim) delim = B->num_lines > 0 && B->lines[0] && strchr(B->lines[0], '\t') ? '\t' : ',';
+    B->csv_delim = delim;
+    B->csv_n = -1;
+    free(B->csv_width);
+    B->csv_width = NULL;
+    B->csv_cols = 0;
+    clearCursors();
+    snprintf(statusmsg, sizeof(statusmsg), "[Column] Split on %s, Tab/Shift-Tab next/previous field",
+             delim == '\t' ? "tabs" : delim == ',' ? "commas" : "the delimiter");
+}
+
+// grows the column widths to fit the rows about to be drawn; widths never shrink, so columns stay put
+void csvMeasure(struct Pane *p) {
+    struct Buffer *b = p->buf;
+    int rows = numRows(b);
+    for (int y = 0; y < p->rows && p->rowoff + y < rows; y++) {
+        int line = rowToLine(b, p->rowoff + y);
+        if (!b->lines[line]) continue;
+        int *t = csvCells(b, line);
+        if (t[0] > b->csv_cols) {
+            b->csv_width = realloc(b->csv_width, t[0] * sizeof(int));
+            if (!b->csv_width) die("realloc");
+            memset(&b->csv_width[b->csv_cols], 0, (t[0] - b->csv_cols) * sizeof(int));
+            b->csv_cols = t[0];
+        }
+        for (int k = 0; k < t[0]; k++) {
+            int w = t[2 + k] - 1 - t[1 + k];
+            if (w > CSV_MAX_WIDTH) w = CSV_MAX_WIDTH;
+            if (w > b->csv_width[k]) b->csv_width[k] = w;
+        }
+    }
+}
+
+// field of line y holding byte x, the delimiter after a field belongs to it
+int csvField(struct Buffer *b, int y, int x) {
+    int *t = csvCells(b, y);
+    int lo = 0, hi = t[0] - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (t[1 + mid] <= x) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// screen column of byte x of line y in the column view
+int csvScreenX(struct Buffer *b, int y, int x) {
+    if (y >= b->num_lines || !b->lines[y]) return x;
+    int *t = csvCells(b, y);
+    int k = csvField(b, y, x), col = 0;
+    for (int i = 0; i < k; i++) {
+        int len = t[2 + i] - 1 - t[1 + i];
+        col += (i < b->csv_cols && b->csv_width[i] > len ? b->csv_width[i] : len) + 1;
+    }
+    return col + x - t[1 + k];
+}
+
+// cells padded to their column width, with a dim | where each delimiter was
+static int drawCsvLine(struct Pane *p, int file_y, struct abuf *ab) {
+    struct Buffer *b = p->buf;
+    const char *line = b->lines[file_y];
+    int *t = csvCells(b, file_y);
+    int col = 0;
+    for (int k = 0; k < t[0] && col < p->cols; k++) {
+        int len = t[2 + k] - 1 - t[1 + k];
+        int w = k < b->csv_cols && b->csv_width[k] > len ? b->csv_width[k] : len;
+        int show = len < p->cols - col ? len : p->cols - col;
+        abAppend(ab, &line[t[1 + k]], show);
+        col += show;
+        for (; col < p->cols && show < w; show++, col++) abAppend(ab, " ", 1);
+        if (k + 1 < t[0] && col < p->cols) {
+            abAppend(ab, "\x1b[2m|\x1b[0m", 9);
+            col++;
+        }
+    }
+    return col;
+}
+
+// Tab and Shift-Tab, on to the next line past the last field
+void csvJumpField(int dir) {
+    if (B->cy >= B->num_lines || !B->lines[B->cy]) return;
+    int k = csvField(B, B->cy, B->cx) + dir;
+    int y = B->cy;
+    if (k < 0 || k >= csvCells(B, y)[0]) {
+        int row = lineToRow(B, y) + dir;
+        if (row < 0 || row >= numRows(B)) return;
+        y = rowToLine(B, row);
+        if (!B->lines[y]) return;
+        k = dir > 0 ? 0 : csvCells(B, y)[0] - 1;
+    }
+    B->cy = y;
+    B->cx = csvCells(B, y)[1 + k];
+    scrollToCursor();
+}
+
+// up and down land in the same field, as far in as the cursor was
+void csvKeepField(int y, int x) {
+    if (y == B->cy || y >= B->num_lines || !B->lines[y] || !B->lines[B->cy]) return;
+    int k = csvField(B, y, x);
+    int into = x - csvCells(B, y)[1 + k];
+    int *t = csvCells(B, B->cy);
+    if (k >= t[0]) k = t[0] - 1;
+    int len = t[2 + k] - 1 - t[1 + k];
+    B->cx = t[1 + k] + (into < len ? into : len);
+}
+
+// drops field col from every line of the range, editing each line and its field table in place
+void deleteColumn(int first, int last, int col) {
+    int changed = 0;
+    for (int y = first; y <= last; y++) {
+        char *line = B->lines[y];
+        if (!line) continue;
+        int *t = csvCells(B, y);
+        if (col >= t[0]) continue;
+        int len = t[t[0] + 1] - 1;
+        // the delimiter after the field goes with it, or the one before for the last field
+        int from = t[1 + col], to = t[2 + col];
+        if (col + 1 == t[0]) {
+            to = len;
+            if (col > 0) from--;
+        }
+        memmove(&line[from], &line[to], len - to + 1);
+        B->csv_cells[y] = NULL; // lineChanged would drop it, it is still right after the shift below
+        B->lines[y] = lineRealloc(line, len - (to - from) + 1);
+        lineChanged(B, y);
+
+        if (t[0] > 1) {
+            for (int k = col + 1; k <= t[0]; k++) t[k] = t[k + 1] - (to - from);
+            t[0]--;
+        } else {
+            t[2] = 1;
+        }
+        B->csv_cells[y] = t;
+        changed++;
+    }
+    if (col < B->csv_cols) {
+        memmove(&B->csv_width[col], &B->csv_width[col + 1], (B->csv_cols - col - 1) * sizeof(int));
+        B->csv_cols--;
+    }
+    if (changed) {
+        int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+        if (B->cx > len) B->cx = len;
+        B->num_matches = 0;
+        B->match_gen++;
+        clearCursors();
+        wordsStale(B);
+        B->dirty = 1;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Column] Deleted column %d from %d lines", col + 1, changed);
+}
+
+/*** Mark Functions ***/
+
+static void markShiftAdd(struct Buffer *b, int i, int delta) {
+    for (i++; i <= b->num_marks; i += i & -i) b->mark_shift[i] += delta;
+}
+
+static int markAt(struct Buffer *b, int i) {
+    int line = b->marks[i].line;
+    for (i++; i > 0; i -= i & -i) line += b->mark_shift[i];
+    return line;
+}
+
+// index of the first mark on or below line
+static int firstMarkFrom(struct Buffer *b, int line) {
+    int lo = 0, hi = b->num_marks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (markAt(b, mid) < line) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// lines were inserted (delta > 0) or deleted (delta < 0) at line at
+void shiftMarks(struct Buffer *b, int at, int delta) {
+    if (b->num_marks == 0 || delta == 0) return;
+    int lo = firstMarkFrom(b, at);
+    if (delta > 0) {
+        markShiftAdd(b, lo, delta);
+        return;
+    }
+    // marks on deleted lines collapse onto the line that took their place
+    int hi = firstMarkFrom(b, at - delta);
+    markShiftAdd(b, hi, delta);
+    for (int i = lo; i < hi; i++) {
+        b->marks[i].line -= markAt(b, i) - at;
+        b->marks[i].col = 0;
+    }
+}
+
+// line of a mark, -1 if it is not set
+int markLine(struct Buffer *b, int name) {
+    if (name < 'a' || name > 'z' || b->num_marks == 0) return -1;
+    int i = b->mark_slot[name - 'a'];
+    if (i < 0) return -1;
+    int line = markAt(b, i);
+    return line < b->num_lines ? line : b->num_lines - 1;
+}
+
+void setMark(int name) {
+    if (name < 'a' || name > 'z') {
+        snprintf(statusmsg, sizeof(statusmsg), "[Mark] Marks are named a-z");
+        return;
+    }
+    if (B->num_marks == 0) memset(B->mark_slot, -1, sizeof(B->mark_slot));
+
+    // fold the shifts into the lines, then re-sort with the new mark
+    struct Mark all[MAX_MARKS];
+    int n = 0;
+    for (int i = 0; i < B->num_marks; i++) {
+        if (B->marks[i].name == name) continue;
+        all[n] = B->marks[i];
+        all[n++].line = markAt(B, i);
+    }
+    int at = n;
+    while (at > 0 && all[at - 1].line > B->cy) at--;
+    memmove(&all[at + 1], &all[at], (n - at) * sizeof(struct Mark));
+    all[at] = (struct Mark){B->cy, B->cx, name};
+    n++;
+
+    memcpy(B->marks, all, n * sizeof(struct Mark));
+    memset(B->mark_shift, 0, sizeof(B->mark_shift));
+    B->num_marks = n;
+    for (int i = 0; i < n; i++) B->mark_slot[B->marks[i].name - 'a'] = i;
+    snprintf(statusmsg, sizeof(statusmsg), "[Mark] '%c set at line %d", name, B->cy + 1);
+}
+
+void jumpMark(int name) {
+    int line = markLine(B, name);
+    if (line < 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Mark] '%c is not set", name);
+        return;
+    }
+    int col = B->marks[B->mark_slot[name - 'a']].col;
+    int len = B->lines[line] ? strlen(B->lines[line]) : 0;
+    B->cy = line;
+    B->cx = col < len ? col : len;
+    revealLine(line);
+    centerCursor();
+    snprintf(statusmsg, sizeof(statusmsg), "[Mark] '%c line %d", name, line + 1);
+}
+
+void listMarks() {
+    int n = snprintf(statusmsg, sizeof(statusmsg), "[Marks]");
+    for (int i = 0; i < B->num_marks && n < (int)sizeof(statusmsg); i++) {
+        n += snprintf(statusmsg + n, sizeof(statusmsg) - n, " '%c:%d", B->marks[i].name, markAt(B, i) + 1);
+    }
+    if (B->num_marks == 0) snprintf(statusmsg, sizeof(statusmsg), "[Marks] none set");
+}
+
+/*** Word Index Functions ***/
+
+static int isWordChar(int c) {
+    return isalnum(c) || c == '_';
+}
+
+// words that sort before w come first, w's own prefixes sort before it
+static int wordCmp(const char *a, const char *w, int len) {
+    int r = strncmp(a, w, len);
+    return r ? r : a[len] != '\0';
+}
+
+static int betterWord(struct WordTable *t, int a, int b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return t->count[b] > t->count[a] ? b : a;
+}
+
+static void buildWordTree(struct WordTable *t) {
+    t->size = 1;
+    while (t->size < t->n) t->size *= 2;
+    free(t->best);
+    t->best = malloc(2 * t->size * sizeof(int));
+    if (!t->best) die("malloc");
+    for (int i = 0; i < t->size; i++) t->best[t->size + i] = i < t->n ? i : -1;
+    for (int i = t->size - 1; i > 0; i--) t->best[i] = betterWord(t, t->best[2 * i], t->best[2 * i + 1]);
+}
+
+static void freeWordTable(struct WordTable *t) {
+    for (int i = 0; i < t->n; i++) free(t->words[i]);
+    free(t->words);
+    free(t->count);
+    free(t->best);
+    memset(t, 0, sizeof(*t));
+}
+
+// first word not below w, or with prefix set the first word past every word starting with w
+static int wordBound(struct WordTable *t, const char *w, int len, int prefix) {
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int r = prefix ? strncmp(t->words[mid], w, len) > 0 : wordCmp(t->words[mid], w, len) >= 0;
+        if (r) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+// most frequent word in lo .. hi - 1, -1 if the range is empty
+static int bestWord(struct WordTable *t, int lo, int hi) {
+    int best = -1;
+    for (lo += t->size, hi += t->size; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) best = betterWord(t, best, t->best[lo++]);
+        if (hi & 1) best = betterWord(t, best, t->best[--hi]);
+    }
+    return best;
+}
+
+static void addWordCount(struct WordTable *t, int i, int delta) {
+    t->count[i] += delta;
+    if (t->count[i] < 0) t->count[i] = 0;
+    for (int k = (t->size + i) / 2; k > 0; k /= 2) t->best[k] = betterWord(t, t->best[2 * k], t->best[2 * k + 1]);
+}
+
+static void insertWord(struct WordTable *t, const char *w, int len, int count) {
+    int at = wordBound(t, w, len, 0);
+    t->words = realloc(t->words, (t->n + 1) * sizeof(char *));
+    t->count = realloc(t->count, (t->n + 1) * sizeof(int));
+    if (!t->words || !t->count) die("realloc");
+    memmove(&t->words[at + 1], &t->words[at], (t->n - at) * sizeof(char *));
+    memmove(&t->count[at + 1], &t->count[at], (t->n - at) * sizeof(int));
+    t->words[at] = strndup(w, len);
+    t->count[at] = count;
+    t->n++;
+    buildWordTree(t);
+}
+
+// fold recent into main with one merge pass
+static void mergeRecentWords(struct WordIndex *wi) {
+    struct WordTable *a = &wi->main, *b = &wi->recent;
+    struct WordTable m = {0};
+    m.words = malloc((a->n + b->n) * sizeof(char *));
+    m.count = malloc((a->n + b->n) * sizeof(int));
+    if (!m.words || !m.count) die("malloc");
+    int i = 0, j = 0;
+    while (i < a->n || j < b->n) {
+        int from_a = j >= b->n || (i < a->n && strcmp(a->words[i], b->words[j]) < 0);
+        m.words[m.n] = from_a ? a->words[i] : b->words[j];
+        m.count[m.n++] = from_a ? a->count[i++] : b->count[j++];
+    }
+    buildWordTree(&m);
+    a->n = b->n = 0; // the strings moved to m
+    freeWordTable(a);
+    freeWordTable(b);
+    wi->main = m;
+}
+
+static void countWord(struct WordIndex *wi, const char *w, int len, int delta, int replay) {
+    if (replay) {
+        if (wi->num_pending == wi->pending_cap) {
+            wi->pending_cap = wi->pending_cap ? 2 * wi->pending_cap : 256;
+            wi->pending = realloc(wi->pending, wi->pending_cap * sizeof(struct WordDelta));
+            if (!wi->pending) die("realloc");
+        }
+        wi->pending[wi->num_pending++] = (struct WordDelta){strndup(w, len), delta};
+    }
+
+    int i = wordBound(&wi->main, w, len, 0);
+    if (i < wi->main.n && wordCmp(wi->main.words[i], w, len) == 0) {
+        addWordCount(&wi->main, i, delta);
+        return;
+    }
+    i = wordBound(&wi->recent, w, len, 0);
+    if (i < wi->recent.n && wordCmp(wi->recent.words[i], w, len) == 0) {
+        addWordCount(&wi->recent, i, delta);
+    } else if (delta > 0) {
+        insertWord(&wi->recent, w, len, delta);
+        if (wi->recent.n >= WORD_RECENT_MAX) mergeRecentWords(wi);
+    }
+}
+
+// count the words in line y overlapping a .. end, widened to whole words
+void indexSpan(struct Buffer *b, int y, const char *line, int a, int end, int delta) {
+    if (!b->words || !line) return;
+    // a build replays the change later if its snapshot already holds the old text
+    int replay = b->words->building || (b->words->copying && y < b->words->copy_line);
+    while (a > 0 && isWordChar((unsigned char)line[a - 1])) a--;
+    while (line[end] && isWordChar((unsigned char)line[end])) end++;
+    for (int i = a; i < end;) {
+        if (!isWordChar((unsigned char)line[i])) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < end && isWordChar((unsigned char)line[i])) i++;
+        if (i - start >= WORD_MIN_LEN && i - start <= WORD_MAX_LEN) countWord(b->words, line + start, i - start, delta, replay);
+    }
+}
+
+void indexLine(struct Buffer *b, int y, const char *line, int delta) {
+    if (line) indexSpan(b, y, line, 0, strlen(line), delta);
+}
+
+// start filling the snapshot over from the first line
+static void restartWordCopy(struct WordIndex *wi) {
+    for (int i = 0; i < wi->num_pending; i++) free(wi->pending[i].word);
+    wi->num_pending = 0;
+    wi->copy_line = 0;
+    wi->snapshot_len = 0;
+    wi->stale = 0;
+}
+
+void wordsStale(struct Buffer *b) {
+    if (!b->words) return;
+    if (b->words->copying) {
+        restartWordCopy(b->words);
+    } else {
+        b->words->stale = 1;
+    }
+}
+
+// count lines at first were replaced by n, the copy front moves with the lines above it
+void wordsReplaced(struct Buffer *b, int first, int count, int n) {
+    struct WordIndex *wi = b->words;
+    if (!wi || !wi->copying || first >= wi->copy_line) return;
+    if (first + count <= wi->copy_line) {
+        wi->copy_line += n - count;
+    } else {
+        restartWordCopy(wi); // half copied, the logged changes can't be split
+    }
+}
+
+// lines were moved around without being reported one by one
+void wordsMoved(struct Buffer *b) {
+    if (b->words && b->words->copying) restartWordCopy(b->words);
+}
+
+struct WordSlot {
+    const char *p;
+    int len;
+    int count;
+};
+
+struct WordCount {
+    char *word;
+    int count;
+};
+
+static int compareWordCount(const void *a, const void *b) {
+    return strcmp(((const struct WordCount *)a)->word, ((const struct WordCount *)b)->word);
+}
+
+// runs on its own thread and only touches the snapshot and next
+static void *wordIndexMain(void *arg) {
+    struct WordIndex *wi = arg;
+    const char *p = wi->snapshot, *end = wi->snapshot + wi->snapshot_len;
+
+    // count distinct words in an open addressing table pointing into the snapshot
+    size_t cap = 1024, used = 0;
+    struct WordSlot *slots = calloc(cap, sizeof(struct WordSlot));
+    if (!slots) die("calloc");
+    while (p < end) {
+        if (!isWordChar((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        const char *start = p;
+        uint64_t h = 14695981039346656037ULL;
+        while (p < end && isWordChar((unsigned char)*p)) h = (h ^ (unsigned char)*p++) * 1099511628211ULL;
+        int len = p - start;
+        if (len < WORD_MIN_LEN || len > WORD_MAX_LEN) continue;
+
+        size_t i = h & (cap - 1);
+        while (slots[i].p && (slots[i].len != len || memcmp(slots[i].p, start, len) != 0)) i = (i + 1) & (cap - 1);
+        if (slots[i].p) {
+            slots[i].count++;
+            continue;
+        }
+        slots[i] = (struct WordSlot){start, len, 1};
+        if (++used * 2 <= cap) continue;
+
+        // grow and rehash
+        struct WordSlot *old = slots;
+        size_t old_cap = cap;
+        cap *= 2;
+        slots = calloc(cap, sizeof(struct WordSlot));
+        if (!slots) die("calloc");
+        for (size_t k = 0; k < old_cap; k++) {
+            if (!old[k].p) continue;
+            uint64_t oh = 14695981039346656037ULL;
+            for (int c = 0; c < old[k].len; c++) oh = (oh ^ (unsigned char)old[k].p[c]) * 1099511628211ULL;
+            size_t j = oh & (cap - 1);
+            while (slots[j].p) j = (j + 1) & (cap - 1);
+            slots[j] = old[k];
+        }
+        free(old);
+    }
+
+    struct WordCount *all = malloc((used + 1) * sizeof(struct WordCount));
+    if (!all) die("malloc");
+    size_t n = 0;
+    for (size_t k = 0; k < cap; k++) {
+        if (slots[k].p) all[n++] = (struct WordCount){strndup(slots[k].p, slots[k].len), slots[k].count};
+    }
+    free(slots);
+    qsort(all, n, sizeof(struct WordCount), compareWordCount);
+
+    struct WordTable *t = &wi->next;
+    t->words = malloc((n + 1) * sizeof(char *));
+    t->count = malloc((n + 1) * sizeof(int));
+    if (!t->words || !t->count) die("malloc");
+    for (size_t k = 0; k < n; k++) {
+        t->words[k] = all[k].word;
+        t->count[k] = all[k].count;
+    }
+    t->n = n;
+    free(all);
+    buildWordTree(t);
+    atomic_store(&wi->built, 1);
+    return NULL;
+}
+
+// copy up to budget bytes of lines into the snapshot, then hand it to the counting thread
+static void copyWords(struct Buffer *b, size_t budget) {
+    struct WordIndex *wi = b->words;
+    size_t done = 0;
+    while (wi->copy_line < b->num_lines && done < budget) {
+        const char *line = b->lines[wi->copy_line] ? b->lines[wi->copy_line] : "";
+        size_t len = strlen(line);
+        if (wi->snapshot_len + len + 1 > wi->snapshot_cap) {
+            size_t cap = wi->snapshot_cap ? 2 * wi->snapshot_cap : WORD_COPY_SLICE;
+            while (cap < wi->snapshot_len + len + 1) cap *= 2;
+            wi->snapshot = realloc(wi->snapshot, cap);
+            if (!wi->snapshot) die("realloc");
+            wi->snapshot_cap = cap;
+        }
+        memcpy(wi->snapshot + wi->snapshot_len, line, len);
+        wi->snapshot[wi->snapshot_len + len] = '\n';
+        wi->snapshot_len += len + 1;
+        done += len + 1;
+        wi->copy_line++;
+    }
+    if (wi->copy_line < b->num_lines) return;
+
+    wi->copying = 0;
+    wi->building = 1;
+    atomic_store(&wi->built, 0);
+    wi->threaded = pthread_create(&wi->thread, NULL, wordIndexMain, wi) == 0;
+    if (!wi->threaded) wordIndexMain(wi); // no thread to be had, count it here
+}
+
+// index b in the background; the main loop copies the text a slice at a time, edits to text
+// already copied are logged and replayed onto the result
+void startWordIndex(struct Buffer *b) {
+    if (!b->words) {
+        b->words = calloc(1, sizeof(struct WordIndex));
+        if (!b->words) die("calloc");
+    }
+    struct WordIndex *wi = b->words;
+    if (wi->building) {
+        wi->stale = 1;
+        return;
+    }
+    wi->copying = 1;
+    restartWordCopy(wi);
+}
+
+static void finishWordIndex(struct WordIndex *wi) {
+    if (wi->threaded) pthread_join(wi->thread, NULL);
+    free(wi->snapshot);
+    wi->snapshot = NULL;
+    wi->snapshot_cap = 0;
+    wi->building = 0;
+    freeWordTable(&wi->main);
+    freeWordTable(&wi->recent);
+    wi->main = wi->next;
+    memset(&wi->next, 0, sizeof(wi->next));
+    wi->ready = 1;
+
+    for (int i = 0; i < wi->num_pending; i++) {
+        countWord(wi, wi->pending[i].word, strlen(wi->pending[i].word), wi->pending[i].delta, 0);
+        free(wi->pending[i].word);
+    }
+    wi->num_pending = 0;
+}
+
+// called from the main loop, copies the next slice of a snapshot and swaps in finished builds
+void pollWordIndex() {
+    for (int i = 0; i < num_buffers; i++) {
+        struct WordIndex *wi = buffers[i]->words;
+        if (wi && wi->copying) copyWords(buffers[i], WORD_COPY_SLICE);
+        if (wi && wi->building && atomic_load(&wi->built)) finishWordIndex(wi);
+    }
+}
+
+// up to k most frequent words of t starting with w, best first
+static int topWords(struct WordTable *t, const char *w, int len, int *out, int k) {
+    int lo[COMPLETE_MAX + 2], hi[COMPLETE_MAX + 2], best[COMPLETE_MAX + 2];
+    lo[0] = wordBound(t, w, len, 0);
+    hi[0] = wordBound(t, w, len, 1);
+    best[0] = bestWord(t, lo[0], hi[0]);
+    int ranges = 1, found = 0;
+
+    // take the best of all ranges, then split its range around it
+    while (found < k) {
+        int r = -1;
+        for (int i = 0; i < ranges; i++) {
+            if (best[i] >= 0 && (r < 0 || t->count[best[i]] > t->count[best[r]])) r = i;
+        }
+        if (r < 0 || t->count[best[r]] <= 0) break;
+        int at = best[r];
+        out[found++] = at;
+        lo[ranges] = at + 1;
+        hi[ranges] = hi[r];
+        best[ranges] = bestWord(t, at + 1, hi[r]);
+        ranges++;
+        hi[r] = at;
+        best[r] = bestWord(t, lo[r], at);
+    }
+    return found;
+}
+
+void completeWord() {
+    if (B->num_cursors > 0 || B->cy >= B->num_lines || !B->lines[B->cy]) return;
+
+    if (complete_count > 0 && B->cy == complete_y && B->cx == complete_x) {
+        // Tab again swaps the inserted word for the next candidate
+        int shown = complete_pick < complete_count ? (int)strlen(complete_words[complete_pick]) : complete_prefix;
+        for (int i = complete_prefix; i < shown; i++) deleteChar();
+        complete_pick = (complete_pick + 1) % (complete_count + 1);
+    } else {
+        const char *line = B->lines[B->cy];
+        int start = B->cx;
+        while (start > 0 && isWordChar((unsigned char)line[start - 1])) start--;
+        complete_prefix = B->cx - start;
+        if (complete_prefix == 0 || complete_prefix > WORD_MAX_LEN) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Complete] No word before the cursor");
+            return;
+        }
+
+        if (!B->words || B->words->stale) startWordIndex(B);
+        struct WordIndex *wi = B->words;
+        // the first build has nothing to fall back on, wait for it
+        if (!wi->ready) {
+            if (wi->copying) copyWords(B, SIZE_MAX);
+            if (wi->building) finishWordIndex(wi);
+        }
+
+        char prefix[WORD_MAX_LEN + 1];
+        memcpy(prefix, line + start, complete_prefix);
+        prefix[complete_prefix] = '\0';
+        int a[COMPLETE_MAX + 1], b[COMPLETE_MAX + 1];
+        int na = topWords(&wi->main, prefix, complete_prefix, a, COMPLETE_MAX + 1);
+        int nb = topWords(&wi->recent, prefix, complete_prefix, b, COMPLETE_MAX + 1);
+
+        // merge both lists by count, skipping the prefix itself
+        complete_count = 0;
+        int i = 0, j = 0;
+        while (complete_count < COMPLETE_MAX && (i < na || j < nb)) {
+            int from_a = j >= nb || (i < na && wi->main.count[a[i]] >= wi->recent.count[b[j]]);
+            const char *w = from_a ? wi->main.words[a[i++]] : wi->recent.words[b[j++]];
+            if ((int)strlen(w) == complete_prefix) continue;
+            strcpy(complete_words[complete_count++], w);
+        }
+        if (complete_count == 0) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Complete] No match for %.40s", prefix);
+            return;
+        }
+        complete_pick = 0;
+    }
+
+    if (complete_pick < complete_count) {
+        for (const char *p = complete_words[complete_pick] + complete_prefix; *p; p++) insertChar(*p);
+    }
+    complete_y = B->cy;
+    complete_x = B->cx;
+
+    int n = snprintf(statusmsg, sizeof(statusmsg), "[Complete]");
+    for (int i = 0; i < complete_count && n < (int)sizeof(statusmsg); i++) {
+        const char *fmt = i == complete_pick ? " [%s]" : " %s";
+        n += snprintf(statusmsg + n, sizeof(statusmsg) - n, fmt, complete_words[i]);
+    }
+}
+
+/*** Input Functions ***/
+
+static int readTerminalKey() {
+    char c;
+    struct timeval tv = {0, 1000}; // 1ms timeout
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+
+    // Wait for input with timeout
+    if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
+        return 0; // no input ready
+    }
+
+    if (read(STDIN_FILENO, &c, 1) != 1) {
+        return 0; // read failed
+    }
+
+    if (c == '\x1b') {
+        char seq[2];
+        // Check for next character
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
+            return '\x1b';
+        }
+        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
+        if (seq[0] == '[') {
+            if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0) {
+                return '\x1b';
+            }
+            if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+            switch (seq[1]) {
+                case 'A': return ARROW_UP;
+                case 'B': return ARROW_DOWN;
+                case 'C': return ARROW_RIGHT;
+                case 'D': return ARROW_LEFT;
+                case 'Z': return SHIFT_TAB;
+            }
+        }
+        return '\x1b'; // consume unrecognized sequences
+    }
+    return c;
+}
+
+int readKey() {
+    if (macro_playing) {
+        return macro_pos < macro_len ? macro_keys[macro_pos++] : 0;
+    }
+    int c;
+    if (num_pending_keys > 0) {
+        c = pending_keys[0];
+        memmove(pending_keys, pending_keys + 1, --num_pending_keys * sizeof(int));
+    } else {
+        c = readTerminalKey();
+    }
+    if (c && macro_recording) {
+        if (macro_len == macro_cap) {
+            macro_cap = macro_cap ? macro_cap * 2 : 64;
+            macro_keys = realloc(macro_keys, macro_cap * sizeof(int));
+            if (!macro_keys) die("realloc");
+        }
+        macro_keys[macro_len++] = c;
+    }
+    return c;
+}
+
+// the line one row above or below y, stepping over lines hidden by a filter or fold; y when there is none
+static int stepRow(int y, int dir) {
+    int row = lineToRow(B, y);
+    if (dir < 0) return row > 0 ? rowToLine(B, row - 1) : y;
+    if (row < numRows(B) && rowToLine(B, row) == y) row++;
+    return row < numRows(B) ? rowToLine(B, row) : y;
+}
+
+void moveCursor(int key) {
+    int from_x = B->cx, from_y = B->cy;
+    switch (key) {
+        case ARROW_LEFT:
+            if (B->cx > 0) B->cx--;
+            break;
+        case ARROW_RIGHT:
+            if (B->cx < editor_cols - 1) B->cx++;
+            break;
+        case ARROW_UP:
+            B->cy = stepRow(B->cy, -1);
+            break;
+        case ARROW_DOWN:
+            B->cy = stepRow(B->cy, 1);
+            break;
+    }
+
+    // adjust scroll offset
+    scrollToCursor();
+
+    // ensure cursor x doesn't exceed line length
+    int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+    if (B->cx > len) B->cx = len;
+    if (B->csv_delim) csvKeepField(from_y, from_x);
+
+    // extra cursors follow the same motion
+    for (int i = 0; i < B->num_cursors; i++) {
+        struct Cursor *cur = &B->cursors[i];
+        if (key == ARROW_LEFT && cur->x > 0) cur->x--;
+        else if (key == ARROW_RIGHT) cur->x++;
+        else if (key == ARROW_UP) cur->y = stepRow(cur->y, -1);
+        else if (key == ARROW_DOWN) cur->y = stepRow(cur->y, 1);
+        len = B->lines[cur->y] ? strlen(B->lines[cur->y]) : 0;
+        if (cur->x > len) cur->x = len;
+    }
+}
+
+// the indent step the buffer already uses: a tab if the nearest indented line starts with one
+static const char *indentUnit(int y) {
+    for (int d = 0; d < 1000; d++) {
+        for (int i = y - d; i <= y + d; i += 2 * d + !d) {
+            if (i < 0 || i >= B->num_lines || !B->lines[i]) continue;
+            if (B->lines[i][0] == '\t') return "\t";
+            if (B->lines[i][0] == ' ') return "    ";
+        }
+    }
+    return "    ";
+}
+
+static int isClosingBracket(char c) {
+    return c == ')' || c == ']' || c == '}';
+}
+
+void insertChar(int c) {
+    if (B->num_cursors > 0) {
+        multiInsertChar(c);
+        return;
+    }
+    ensureLineCapacity(B->cy + 1);
+
+    if (B->lines[B->cy] == NULL) {
+        B->lines[B->cy] = lineAlloc(1);
+        B->lines[B->cy][0] = '\0';
+    }
+
+    int len = strlen(B->lines[B->cy]);
+    if (B->cx > len) B->cx = len;
+
+    // a closing bracket typed into the indent steps it back to the opening line's level
+    if (auto_indent && isClosingBracket(c) && B->cx > 0) {
+        int lead = 0;
+        while (B->lines[B->cy][lead] == ' ' || B->lines[B->cy][lead] == '\t') lead++;
+        if (lead >= B->cx) {
+            int drop = B->lines[B->cy][B->cx - 1] == '\t' ? 1 : (B->cx - 1) % 4 + 1;
+            while (drop-- > 0 && B->cx > 0) deleteChar();
+            len = strlen(B->lines[B->cy]);
+        }
+    }
+
+    indexSpan(B, B->cy, B->lines[B->cy], B->cx, B->cx, -1);
+    struct LineStats before = spanStats(B->lines[B->cy], B->cx, B->cx);
+    B->lines[B->cy] = lineRealloc(B->lines[B->cy], len + 2);
+    memmove(&B->lines[B->cy][B->cx + 1], &B->lines[B->cy][B->cx], len - B->cx + 1);
+    B->lines[B->cy][B->cx] = c;
+    indexSpan(B, B->cy, B->lines[B->cy], B->cx, B->cx + 1, 1);
+    B->cx++;
+    if (B->cy >= B->num_lines) B->num_lines = B->cy + 1;
+    lineEdited(B, B->cy, before, spanStats(B->lines[B->cy], B->cx - 1, B->cx));
+    if (strchr("()[]{}", c)) bracketsChanged(B, B->cy);
+    B->dirty = 1;
+}
+
+void deleteChar() {
+    if (B->num_cursors > 0) {
+        multiDeleteChar();
+        return;
+    }
+    if (B->cy >= B->num_lines || !B->lines[B->cy]) return;
+    if (B->cx > 0 || B->cy > 0) B->dirty = 1;
+
+    if (B->cx > 0) {
+        int len = strlen(B->lines[B->cy]);
+        indexSpan(B, B->cy, B->lines[B->cy], B->cx - 1, B->cx, -1);
+        struct LineStats before = spanStats(B->lines[B->cy], B->cx - 1, B->cx);
+        int bracket = strchr("()[]{}", B->lines[B->cy][B->cx - 1]) != NULL;
+        memmove(&B->lines[B->cy][B->cx - 1], &B->lines[B->cy][B->cx], len - B->cx + 1);
+        B->lines[B->cy] = lineRealloc(B->lines[B->cy], len);
+        indexSpan(B, B->cy, B->lines[B->cy], B->cx - 1, B->cx - 1, 1);
+        lineEdited(B, B->cy, before, spanStats(B->lines[B->cy], B->cx - 1, B->cx - 1));
+        if (bracket) bracketsChanged(B, B->cy);
+        B->cx--;
+    } else if (B->cy > 0) {
+        int prev_len = strlen(B->lines[B->cy - 1]);
+        int curr_len = strlen(B->lines[B->cy]);
+
+        // the words meeting at the join become one; a snapshot being copied takes both lines or neither
+        if (B->words && B->words->copying && B->words->copy_line == B->cy) copyWords(B, 1);
+        indexSpan(B, B->cy - 1, B->lines[B->cy - 1], prev_len, prev_len, -1);
+        indexSpan(B, B->cy, B->lines[B->cy], 0, 0, -1);
+        B->lines[B->cy - 1] = lineRealloc(B->lines[B->cy - 1], prev_len + curr_len + 1);
+        strcat(B->lines[B->cy - 1], B->lines[B->cy]);
+        indexSpan(B, B->cy - 1, B->lines[B->cy - 1], prev_len, prev_len, 1);
+
+        lineFree(B->lines[B->cy]);
+        for (int i = B->cy; i < B->num_lines - 1; i++) {
+            B->lines[i] = B->lines[i + 1];
+        }
+        B->lines[B->num_lines - 1] = NULL;
+        B->num_lines--;
+        viewLinesDeleted(B, B->cy, 1);
+        B->cy--;
+        lineChanged(B, B->cy);
+        B->cx = prev_len;
+    }
+}
+
+void insertNewline() {
+    if (B->num_cursors > 0) {
+        multiInsertNewline();
+        return;
+    }
+    ensureLineCapacity(B->num_lines + 1);
+
+    char *line = B->lines[B->cy];
+    if (!line) {
+        B->cy++;
+        B->cx = 0;
+        return;
+    }
+
+    int len = strlen(line);
+    if (B->cx > len) B->cx = len;
+
+    // the new line keeps the indent, one step deeper after an opening bracket;
+    // blanks the split leaves at the start of the moved text are dropped
+    int indent = 0, skip = 0, end = B->cx;
+    if (auto_indent) {
+        while (indent < B->cx && (line[indent] == ' ' || line[indent] == '\t')) indent++;
+        while (line[B->cx + skip] == ' ' || line[B->cx + skip] == '\t') skip++;
+    }
+    while (end > indent && (line[end - 1] == ' ' || line[end - 1] == '\t')) end--;
+    const char *unit = "";
+    if (auto_indent && end > indent && bracketValue(line[end - 1]) > 0 && !isClosingBracket(line[B->cx + skip])) unit = indentUnit(B->cy);
+    int unit_len = strlen(unit);
+    int prefix = indent + unit_len;
+
+    char *left = lineAlloc(B->cx + 1);
+    char *right = lineAlloc(prefix + len - B->cx - skip + 1);
+
+    memcpy(left, line, B->cx);
+    left[B->cx] = '\0';
+    memcpy(right, line, indent);
+    memcpy(right + indent, unit, unit_len);
+    strcpy(right + prefix, &line[B->cx + skip]);
+    // right is counted against line cy, whose old text holds it in a snapshot being copied
+    indexSpan(B, B->cy, line, B->cx, B->cx + skip, -1);
+    indexSpan(B, B->cy, left, B->cx, B->cx, 1);
+    indexSpan(B, B->cy, right, prefix, prefix, 1);
+
+    B->lines[B->cy] = left;
+    lineFree(line);
+
+    for (int i = B->num_lines; i > B->cy + 1; i--) {
+        B->lines[i] = B->lines[i - 1];
+    }
+
+    B->lines[B->cy + 1] = right;
+    B->num_lines++;
+    viewLinesInserted(B, B->cy + 1, 1);
+    if (B->words && B->words->copying && B->words->copy_line == B->cy + 1) B->words->copy_line++;
+    lineChanged(B, B->cy);
+    B->cy++;
+    B->cx = prefix;
+    B->dirty = 1;
+}
+
+void toggleVisualMode() {
+    if (visual_mode) {
+        visual_mode = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+    } else {
+        visual_mode = 1;
+        clearCursors();
+        sx = B->cx;
+        sy = B->cy;
+        snprintf(statusmsg, sizeof(statusmsg), "[Visual Mode]");
+    }
+}
+
+void copySelection() {
+    if (!visual_mode) return;
+    if (visual_mode == 2) {
+        copyBlock();
+        visual_mode = 0;
+        return;
+    }
+
+    // boundarys of selection
+    int start_y = sy < B->cy ? sy : B->cy;
+    int end_y = sy < B->cy ? B->cy : sy;
+    int start_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? sx : B->cx;
+    int end_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? B->cx : sx;
+
+    // handle same-line selection
+    if (start_y == end_y && start_x == end_x) {
+        storeYank(newSpan(0, 0));
+        visual_mode = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Copied 0 chars]");
+        return;
+    }
+
+    // the size comes from the line counts, line lengths from their cache
+    int rows;
+    int clip_len = selectionStats(&rows).bytes;
+    statsSync(B);
+
+    // allocate and copy to clipboard
+    struct Span *span = newSpan(clip_len, 0);
+    char *clipboard = span->text;
+    int pos = 0;
+    for (int y = start_y; y <= end_y; y++) {
+        if (B->lines[y]) {
+            int len = statsLine(B, y)->bytes - 1;
+            int x_start = (y == start_y) ? start_x : 0;
+            int x_end = (y == end_y) ? end_x : len;
+            memcpy(&clipboard[pos], &B->lines[y][x_start], x_end - x_start);
+            pos += x_end - x_start;
+            if (y < end_y) clipboard[pos++] = '\n';
+        }
+    }
+    clipboard[pos] = '\0';
+    span->len = clip_len = pos;
+    storeYank(span);
+
+    // exit visual mode
+    visual_mode = 0;
+    snprintf(statusmsg, sizeof(statusmsg), "[Copied %d chars]", clip_len);
+}
+
+void cutSelection() {
+    if (!visual_mode) return;
+    if (visual_mode == 2) {
+        copyBlock();
+        deleteBlock();
+        snprintf(statusmsg, sizeof(statusmsg), "[Cut %d chars]", yank_ring[0]->len);
+        return;
+    }
+
+    // copy selection to clipboard first
+    copySelection();
+
+    // determine selection boundaries
+    int start_y = sy < B->cy ? sy : B->cy;
+    int end_y = sy < B->cy ? B->cy : sy;
+    int start_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? sx : B->cx;
+    int end_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? B->cx : sx;
+
+    // handle same-line selection
     if (start_y == end_y) {
         if (start_x == end_x) {
             visual_mode = 0;
             snprintf(statusmsg, sizeof(statusmsg), "[Cut 0 chars]");
             return;
         }
-        int len = strlen(lines[start_y]);
-        memmove(&lines[start_y][start_x], &lines[start_y][end_x], len - end_x + 1);
-        lines[start_y] = realloc(lines[start_y], len - (end_x - start_x) + 1);
-        cx = start_x;
-        cy = start_y;
+        int len = strlen(B->lines[start_y]);
+        memmove(&B->lines[start_y][start_x], &B->lines[start_y][end_x], len - end_x + 1);
+        B->lines[start_y] = lineRealloc(B->lines[start_y], len - (end_x - start_x) + 1);
+        B->cx = start_x;
+        B->cy = start_y;
+    } else {
+        // handle multi-line selection
+        // first line: keep text before start_x
+        int first_len = strlen(B->lines[start_y]);
+        B->lines[start_y] = lineRealloc(B->lines[start_y], start_x + 1);
+        B->lines[start_y][start_x] = '\0';
+
+        // last line: keep text after end_x
+        int last_len = strlen(B->lines[end_y]);
+        char *last_part = lineAlloc(last_len - end_x + 1);
+        strcpy(last_part, &B->lines[end_y][end_x]);
+        lineFree(B->lines[end_y]);
+        B->lines[end_y] = last_part;
+
+        // concatenate first and last lines
+        int new_len = strlen(B->lines[start_y]) + strlen(B->lines[end_y]) + 1;
+        B->lines[start_y] = lineRealloc(B->lines[start_y], new_len);
+        strcat(B->lines[start_y], B->lines[end_y]);
+        lineFree(B->lines[end_y]);
+
+        // remove intermediate lines
+        for (int i = start_y + 1; i < end_y; i++) {
+            lineFree(B->lines[i]);
+            B->lines[i] = NULL;
+        }
+        for (int i = start_y + 1; i < B->num_lines - (end_y - start_y); i++) {
+            B->lines[i] = B->lines[i + (end_y - start_y)];
+        }
+        for (int i = B->num_lines - (end_y - start_y); i < B->num_lines; i++) {
+            B->lines[i] = NULL;
+        }
+        B->num_lines -= (end_y - start_y);
+        viewLinesDeleted(B, start_y + 1, end_y - start_y);
+
+        B->cx = start_x;
+        B->cy = start_y;
+    }
+
+    // exit visual mode
+    visual_mode = 0;
+    B->dirty = 1;
+    lineChanged(B, B->cy);
+    wordsStale(B);
+    snprintf(statusmsg, sizeof(statusmsg), "[Cut %d chars]", yank_ring[0]->len);
+
+    // adjust scroll offset
+    scrollToCursor();
+}
+
+void deleteSelection() {
+    if (!visual_mode) return;
+    if (visual_mode == 2) {
+        deleteBlock();
+        return;
+    }
+
+    // determine selection boundaries
+    int start_y = sy < B->cy ? sy : B->cy;
+    int end_y = sy < B->cy ? B->cy : sy;
+    int start_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? sx : B->cx;
+    int end_x = (sy < B->cy || (sy == B->cy && sx <= B->cx)) ? B->cx : sx;
+
+    // calculate deleted chars for status message
+    int deleted_chars = 0;
+    for (int y = start_y; y <= end_y; y++) {
+        if (B->lines[y]) {
+            int len = strlen(B->lines[y]);
+            int x_start = (y == start_y) ? start_x : 0;
+            int x_end = (y == end_y) ? end_x : len;
+            deleted_chars += x_end - x_start;
+            if (y < end_y) deleted_chars++; // For newline
+        }
+    }
+
+    // handle same-line selection
+    if (start_y == end_y) {
+        if (start_x == end_x) {
+            visual_mode = 0;
+            snprintf(statusmsg, sizeof(statusmsg), "[Deleted 0 chars]");
+            return;
+        }
+        int len = strlen(B->lines[start_y]);
+        memmove(&B->lines[start_y][start_x], &B->lines[start_y][end_x], len - end_x + 1);
+        B->lines[start_y] = lineRealloc(B->lines[start_y], len - (end_x - start_x) + 1);
+        B->cx = start_x;
+        B->cy = start_y;
+    } else {
+        // handle multi-line selection
+        // first line: keep text before start_x
+        int first_len = strlen(B->lines[start_y]);
+        B->lines[start_y] = lineRealloc(B->lines[start_y], start_x + 1);
+        B->lines[start_y][start_x] = '\0';
+
+        // last line: keep text after end_x
+        int last_len = strlen(B->lines[end_y]);
+        char *last_part = lineAlloc(last_len - end_x + 1);
+        strcpy(last_part, &B->lines[end_y][end_x]);
+        lineFree(B->lines[end_y]);
+        B->lines[end_y] = last_part;
+
+        // concatenate first and last lines
+        int new_len = strlen(B->lines[start_y]) + strlen(B->lines[end_y]) + 1;
+        B->lines[start_y] = lineRealloc(B->lines[start_y], new_len);
+        strcat(B->lines[start_y], B->lines[end_y]);
+        lineFree(B->lines[end_y]);
+
+        // remove intermediate lines
+        for (int i = start_y + 1; i < end_y; i++) {
+            lineFree(B->lines[i]);
+            B->lines[i] = NULL;
+        }
+        for (int i = start_y + 1; i < B->num_lines - (end_y - start_y); i++) {
+            B->lines[i] = B->lines[i + (end_y - start_y)];
+        }
+        for (int i = B->num_lines - (end_y - start_y); i < B->num_lines; i++) {
+            B->lines[i] = NULL;
+        }
+        B->num_lines -= (end_y - start_y);
+        viewLinesDeleted(B, start_y + 1, end_y - start_y);
+
+        B->cx = start_x;
+        B->cy = start_y;
+    }
+
+    // exit visual mode
+    visual_mode = 0;
+    B->dirty = 1;
+    lineChanged(B, B->cy);
+    wordsStale(B);
+    snprintf(statusmsg, sizeof(statusmsg), "[Deleted %d chars]", deleted_chars);
+
+    // adjust scroll offset
+    scrollToCursor();
+}
+
+void pasteClipboard() {
+    pasteSpan(yank_ring[0]);
+}
+
+// block corners are the selection start and the cursor, both columns included
+void blockBounds(int *top, int *bottom, int *left, int *right) {
+    *top = sy < B->cy ? sy : B->cy;
+    *bottom = sy < B->cy ? B->cy : sy;
+    *left = sx < B->cx ? sx : B->cx;
+    *right = (sx < B->cx ? B->cx : sx) + 1; // exclusive
+}
+
+void toggleBlockMode() {
+    visual_mode = visual_mode == 2 ? 1 : 2;
+    snprintf(statusmsg, sizeof(statusmsg), visual_mode == 2 ? "[Visual Block]" : "[Visual Mode]");
+}
+
+void copyBlock() {
+    int top, bottom, left, right;
+    blockBounds(&top, &bottom, &left, &right);
+
+    // every row is at most the block width plus a newline, so one pass fills it
+    struct Span *span = newSpan((bottom - top + 1) * (right - left + 1), 1);
+    char *clipboard = span->text;
+    int pos = 0;
+    for (int y = top; y <= bottom && y < B->num_lines; y++) {
+        char *line = B->lines[y];
+        int len = line ? strlen(line) : 0;
+        if (len > left) {
+            int end = len < right ? len : right;
+            memcpy(&clipboard[pos], &line[left], end - left);
+            pos += end - left;
+        }
+        if (y < bottom) clipboard[pos++] = '\n';
+    }
+    clipboard[pos] = '\0';
+    span->len = pos;
+    storeYank(span);
+    snprintf(statusmsg, sizeof(statusmsg), "[Copied %d chars]", pos);
+}
+
+void deleteBlock() {
+    int top, bottom, left, right;
+    blockBounds(&top, &bottom, &left, &right);
+
+    // lines only shrink, so each one is closed up in place
+    int deleted = 0;
+    for (int y = top; y <= bottom && y < B->num_lines; y++) {
+        char *line = B->lines[y];
+        if (!line) continue;
+        int len = strlen(line);
+        if (len <= left) continue;
+        int end = len < right ? len : right;
+        memmove(&line[left], &line[end], len - end + 1);
+        lineChanged(B, y);
+        deleted += end - left;
+    }
+
+    visual_mode = 0;
+    B->cx = left;
+    B->cy = top;
+    if (B->lines[top] && B->cx > (int)strlen(B->lines[top])) B->cx = strlen(B->lines[top]);
+    if (deleted) B->dirty = 1;
+    wordsStale(B);
+    scrollToCursor();
+    snprintf(statusmsg, sizeof(statusmsg), "[Deleted %d chars]", deleted);
+}
+
+// each clipboard row goes in at the cursor column of successive lines
+void pasteBlock(struct Span *s) {
+    const char *clipboard = s->text;
+    int clip_len = s->len;
+    int x = B->cx, y = B->cy;
+    int rows = 1;
+    for (int i = 0; i < clip_len; i++) {
+        if (clipboard[i] == '\n') rows++;
+    }
+    ensureLineCapacity(y + rows);
+
+    const char *row = clipboard;
+    for (int r = 0; r < rows; r++, y++) {
+        const char *nl = memchr(row, '\n', clip_len - (row - clipboard));
+        int n = nl ? nl - row : clip_len - (row - clipboard);
+
+        char *line = B->lines[y];
+        int len = line ? strlen(line) : 0;
+        int pad = len < x ? x - len : 0;
+        line = lineRealloc(line, len + pad + n + 1);
+        if (pad) {
+            memset(&line[len], ' ', pad);
+            len += pad;
+        }
+        memmove(&line[x + n], &line[x], len - x);
+        memcpy(&line[x], row, n);
+        line[len + n] = '\0';
+        B->lines[y] = line;
+        lineChanged(B, y);
+
+        if (nl) row = nl + 1;
+    }
+    if (y > B->num_lines) {
+        viewLinesInserted(B, B->num_lines, y - B->num_lines);
+        B->num_lines = y;
+    }
+    B->dirty = 1;
+    wordsStale(B);
+    snprintf(statusmsg, sizeof(statusmsg), "[Pasted %d rows]", rows);
+}
+
+/*** Registers Functions ***/
+
+struct Span *newSpan(int len, int block) {
+    struct Span *s = malloc(sizeof(struct Span) + len + 1);
+    if (!s) die("malloc");
+    s->refs = 1;
+    s->len = len;
+    s->block = block;
+    s->text[0] = '\0';
+    return s;
+}
+
+void spanRef(struct Span *s) {
+    if (s) s->refs++;
+}
+
+void spanUnref(struct Span *s) {
+    if (s && --s->refs == 0) free(s);
+}
+
+// takes over the caller's reference; the ring and the named register share the one copy
+void storeYank(struct Span *s) {
+    spanUnref(yank_ring[YANK_RING - 1]);
+    memmove(&yank_ring[1], &yank_ring[0], (YANK_RING - 1) * sizeof(struct Span *));
+    yank_ring[0] = s;
+    if (yank_register >= 0) {
+        spanUnref(registers[yank_register]);
+        spanRef(s);
+        registers[yank_register] = s;
+        yank_register = -1;
+    }
+    sendOsc52(s);
+}
+
+void pasteSpan(struct Span *s) {
+    if (!s) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Register empty]");
+        return;
+    }
+    if (s->block) {
+        pasteBlock(s);
+        return;
+    }
+
+    for (int i = 0; i < s->len; i++) {
+        if (s->text[i] == '\n') {
+            insertNewline();
+        } else {
+            insertChar(s->text[i]);
+        }
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Pasted %d chars]", s->len);
+}
+
+void pasteRegister(int c) {
+    if (c >= 'a' && c <= 'z') {
+        pasteSpan(registers[c - 'a']);
+    } else if (c >= '0' && c <= '9') {
+        pasteSpan(yank_ring[c - '0']);
+    } else {
+        snprintf(statusmsg, sizeof(statusmsg), "[Paste] no register %c", c);
+    }
+}
+
+// hand the yank to the terminal's clipboard, base64 encoded a chunk at a time
+void sendOsc52(struct Span *s) {
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char out[OSC52_CHUNK / 3 * 4];
+    const unsigned char *in = (const unsigned char *)s->text;
+
+    if (s->len == 0) return;
+    write(STDOUT_FILENO, "\x1b]52;c;", 7);
+    for (int off = 0; off < s->len; off += OSC52_CHUNK) {
+        int n = s->len - off < OSC52_CHUNK ? s->len - off : OSC52_CHUNK;
+        int o = 0;
+        for (int i = off; i < off + n; i += 3) {
+            int rest = off + n - i;
+            unsigned v = in[i] << 16 | (rest > 1 ? in[i + 1] << 8 : 0) | (rest > 2 ? in[i + 2] : 0);
+            out[o++] = b64[v >> 18 & 63];
+            out[o++] = b64[v >> 12 & 63];
+            out[o++] = rest > 1 ? b64[v >> 6 & 63] : '=';
+            out[o++] = rest > 2 ? b64[v & 63] : '=';
+        }
+        write(STDOUT_FILENO, out, o);
+    }
+    write(STDOUT_FILENO, "\x07", 1);
+}
+
+/*** Macros Functions ***/
+
+void toggleMacroRecording() {
+    if (macro_recording) {
+        macro_recording = 0;
+        macro_len--; // drop the Ctrl-K that ended the recording
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Recorded %d keys", macro_len);
+    } else {
+        macro_recording = 1;
+        macro_len = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Recording, Ctrl-K to stop");
+    }
+}
+
+void enterMacroPrompt() {
+    if (macro_recording || macro_playing) {
+        // a macro that replays itself would never end
+        if (macro_recording) macro_len--;
+        macro_failed = 1;
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Can't play while recording");
+        editorRefreshScreen();
+        return;
+    }
+    enterSearchMode();
+    prompt_kind = PROMPT_MACRO;
+    prompt_label = "[Macro] Repeat count: ";
+    snprintf(statusmsg, sizeof(statusmsg), "%s", prompt_label);
+    editorRefreshScreen();
+}
+
+// keys are fed straight into processKeypress, the screen is redrawn once at the end
+void playMacro(int count) {
+    if (macro_len == 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Nothing recorded");
+        editorRefreshScreen();
+        return;
+    }
+
+    int done = 0;
+    macro_playing = 1;
+    macro_failed = 0;
+    for (; done < count && !macro_failed; done++) {
+        macro_pos = 0;
+        while (macro_pos < macro_len && !macro_failed) processKeypress();
+    }
+    macro_playing = 0;
+
+    if (macro_failed) {
+        char why[80];
+        snprintf(why, sizeof(why), "%s", statusmsg);
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Stopped in run %d: %.40s", done, why);
+    } else {
+        snprintf(statusmsg, sizeof(statusmsg), "[Macro] Ran %d times", done);
+    }
+    full_redraw = 1;
+    editorRefreshScreen();
+}
+
+/*** Command Line Functions ***/
+
+void enterCommandMode() {
+    int top = sy < B->cy ? sy : B->cy, bottom = sy < B->cy ? B->cy : sy;
+    int from_selection = visual_mode;
+    enterSearchMode();
+    prompt_kind = PROMPT_COMMAND;
+    prompt_label = "[Command] :";
+    if (from_selection) {
+        // start with the selected lines as the range, e.g. for :!cmd
+        visual_mode = 0;
+        B->search_query_len = snprintf(B->search_query, sizeof(B->search_query), "%d,%d", top + 1, bottom + 1);
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "%s%.60s", prompt_label, B->search_query);
+    editorRefreshScreen();
+}
+
+// 1-based line number, '.' or '$'; returns 0 if there is none
+static int parseAddress(const char **p, int *line) {
+    while (**p == ' ') (*p)++;
+    if (**p == '.') {
+        *line = B->cy + 1;
+    } else if (**p == '$') {
+        *line = B->num_lines;
+    } else if (**p == '\'' && (*p)[1] >= 'a' && (*p)[1] <= 'z') {
+        *line = markLine(B, (*p)[1]) + 1;
+        if (*line <= 0) return 0;
+        (*p)++;
+    } else if (isdigit((unsigned char)**p)) {
+        *line = 0;
+        while (isdigit((unsigned char)**p)) *line = *line * 10 + (*(*p)++ - '0');
+        return 1;
+    } else {
+        return 0;
+    }
+    (*p)++;
+    return 1;
+}
+
+// the buffer changed wholesale, keep the cursor inside it and drop stale matches
+static void afterBulkEdit() {
+    if (B->cy >= B->num_lines) B->cy = B->num_lines > 0 ? B->num_lines - 1 : 0;
+    int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+    if (B->cx > len) B->cx = len;
+    if (B->filter_on) buildFilter(B);
+    clearFolds(B);
+    scrollToCursor();
+    B->num_matches = 0;
+    B->match_gen++;
+    clearCursors();
+    B->dirty = 1;
+    wordsStale(B);
+}
+
+void runCommand(const char *cmd) {
+    const char *p = cmd;
+    int has_range = 0, first = B->cy, last = B->cy, a, b;
+
+    while (*p == ' ') p++;
+    if (pager_view && pagerCommand(p)) return;
+    if (hex_view && hexCommand(p)) return;
+    if (*p == '%') {
+        p++;
+        has_range = 1;
+        first = 0;
+        last = B->num_lines - 1;
+    } else if (parseAddress(&p, &a)) {
+        has_range = 1;
+        first = last = a - 1;
+        if (*p == ',') {
+            p++;
+            if (!parseAddress(&p, &b)) {
+                snprintf(statusmsg, sizeof(statusmsg), "[Command] Bad range");
+                return;
+            }
+            last = b - 1;
+        }
+    }
+    while (*p == ' ') p++;
+
+    // N% is a percentage, not a line, so it must not be clamped to the buffer first
+    if (*p == '%' && has_range && first == last) {
+        gotoPercent(last + 1);
+        return;
+    }
+
+    if (first < 0) first = 0;
+    if (last >= B->num_lines) last = B->num_lines - 1;
+    if (has_range && first > last && *p != '\0') {
+        snprintf(statusmsg, sizeof(statusmsg), "[Command] Bad range");
+        return;
+    }
+
+    if (*p == '\0') {
+        // a bare address moves there
+        if (has_range) gotoLine(last);
+    } else if (strncmp(p, "goto", 4) == 0) {
+        if (hex_view) hexGoto(strtoll(p + 4, NULL, 0));
+        else gotoByte(atoll(p + 4) - 1);
+    } else if (strcmp(p, "hex") == 0) {
+        if (!hex_view) enterHexView();
+        else if (B->binary) snprintf(statusmsg, sizeof(statusmsg), "[Hex] Binary file, it has no text view");
+        else if (hex_num_patches > 0) snprintf(statusmsg, sizeof(statusmsg), "[Hex] Unsaved bytes, Ctrl-S or Esc first");
+        else exitHexView();
+    } else if (strcmp(p, "pager") == 0) {
+        if (hex_view) snprintf(statusmsg, sizeof(statusmsg), "[Pager] Leave the hex view first");
+        else enterPagerView();
+    } else if (strncmp(p, "mark ", 5) == 0 || (*p == 'k' && p[1] == ' ')) {
+        p = strchr(p, ' ');
+        while (*p == ' ') p++;
+        if (has_range) B->cy = last, B->cx = 0;
+        setMark(*p);
+    } else if (strcmp(p, "reindent") == 0 || *p == '=') {
+        if (!has_range) first = 0, last = B->num_lines - 1;
+        reindentLines(first, last);
+    } else if (strncmp(p, "csv", 3) == 0 && (p[3] == '\0' || p[3] == ' ')) {
+        toggleColumnView(p + 3);
+    } else if (strcmp(p, "tsv") == 0) {
+        toggleColumnView("\t");
+    } else if (strncmp(p, "delcol", 6) == 0) {
+        if (!B->csv_delim) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Column] Turn on the column view with :csv first");
+            return;
+        }
+        if (!has_range) first = 0, last = B->num_lines - 1;
+        int col = atoi(p + 6) - 1;
+        if (col < 0) col = B->lines[B->cy] ? csvField(B, B->cy, B->cx) : 0;
+        deleteColumn(first, last, col);
+    } else if (strncmp(p, "json", 4) == 0 && (p[4] == '\0' || p[4] == ' ')) {
+        p += 4;
+        while (*p == ' ') p++;
+        if (!has_range) first = 0, last = B->num_lines - 1;
+        if (*p == '\0' || strcmp(p, "pretty") == 0) formatJson(first, last, 1);
+        else if (strcmp(p, "min") == 0) formatJson(first, last, 0);
+        else jsonNavigate(p);
+    } else if (strcmp(p, "marks") == 0) {
+        listMarks();
+    } else if (*p == 's' && p[1] && !isalnum((unsigned char)p[1])) {
+        substituteLines(first, last, p + 1);
+    } else if ((*p == 'g' || *p == 'v') && p[1] && !isalnum((unsigned char)p[1])) {
+        if (!has_range) first = 0, last = B->num_lines - 1;
+        globalDelete(first, last, p + 1, *p == 'v');
+    } else if (strcmp(p, "fold") == 0) {
+        if (!has_range) {
+            toggleFold();
+        } else {
+            addFold(B, first, last);
+            // the cursor goes to the header of the fold that now holds the range
+            B->cy = first;
+            int row = lineToRow(B, B->cy);
+            if (lineHidden(B, B->cy) && row > 0) B->cy = rowToLine(B, row - 1);
+            snprintf(statusmsg, sizeof(statusmsg), "[Fold] Folded %d lines", last - first);
+        }
+        scrollToCursor();
+    } else if (strcmp(p, "unfold") == 0) {
+        clearFolds(B);
+        scrollToCursor();
+        snprintf(statusmsg, sizeof(statusmsg), "[Fold] All folds opened");
+    } else if (strncmp(p, "sort", 4) == 0) {
+        if (!has_range) first = 0, last = B->num_lines - 1;
+        sortLines(first, last, p + 4);
+    } else if (*p == '!') {
+        filterLines(first, last, p + 1);
+    } else if (strcmp(p, "w") == 0 || strcmp(p, "wq") == 0) {
+        saveFile(B->filename);
+        if (p[1] == 'q' && !B->dirty) {
+            write(STDOUT_FILENO, "\x1b[2J", 4);
+            write(STDOUT_FILENO, "\x1b[H", 3);
+            exit(0);
+        }
+    } else if (strcmp(p, "q") == 0) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        exit(0);
+    } else if (*p == 'e' && p[1] == ' ') {
+        p += 2;
+        while (*p == ' ') p++;
+        if (!*p) return;
+        if (!showBuffer(openBuffer(p))) return;
+        snprintf(statusmsg, sizeof(statusmsg), "[Buffer %d/%d] %s", current_buffer + 1, num_buffers, B->filename);
+    } else {
+        snprintf(statusmsg, sizeof(statusmsg), "[Command] Unknown: %.60s", p);
+    }
+}
+
+// put n new lines in place of count lines starting at first, taking ownership of repl
+void replaceLines(int first, int count, char **repl, int n) {
+    for (int i = first; i < first + count; i++) lineFree(B->lines[i]);
+    ensureLineCapacity(B->num_lines - count + n + 1);
+    int tail = B->num_lines - first - count;
+    memmove(&B->lines[first + n], &B->lines[first + count], tail * sizeof(char *));
+    memcpy(&B->lines[first], repl, n * sizeof(char *));
+    for (int i = B->num_lines - count + n; i < B->num_lines; i++) B->lines[i] = NULL;
+    B->num_lines += n - count;
+    linesReplaced(B, first, count, n);
+    // marks below the range follow it, marks on dropped lines go to its end
+    if (n < count) shiftMarks(B, first + n, n - count);
+    else shiftMarks(B, first + count, n - count);
+}
+
+// s/pat/rep/[g], plain text like search, \ escapes the delimiter
+void substituteLines(int first, int last, const char *arg) {
+    char delim = *arg++;
+    char pat[MAX_SEARCH_LEN], rep[MAX_SEARCH_LEN];
+    char *parts[2] = {pat, rep};
+    for (int k = 0; k < 2; k++) {
+        int n = 0;
+        while (*arg && *arg != delim) {
+            if (*arg == '\\' && arg[1] == delim) arg++;
+            if (n < MAX_SEARCH_LEN - 1) parts[k][n++] = *arg;
+            arg++;
+        }
+        parts[k][n] = '\0';
+        if (*arg) arg++;
+    }
+    int global = strchr(arg, 'g') != NULL;
+    int pat_len = strlen(pat), rep_len = strlen(rep);
+    if (pat_len == 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Command] Empty pattern");
+        return;
+    }
+
+    int subs = 0, changed = 0;
+    for (int y = first; y <= last; y++) {
+        char *line = B->lines[y];
+        if (!line) continue;
+        char *hit = strstr(line, pat);
+        if (!hit) continue;
+
+        // count first so the new line is allocated once
+        int n = 0;
+        for (char *h = hit; h; h = global ? strstr(h + pat_len, pat) : NULL) n++;
+        int len = strlen(line);
+        char *out = lineAlloc(len + n * (rep_len - pat_len) + 1);
+        char *o = out, *from = line;
+        for (int i = 0; i < n; i++) {
+            memcpy(o, from, hit - from);
+            o += hit - from;
+            memcpy(o, rep, rep_len);
+            o += rep_len;
+            from = hit + pat_len;
+            if (i + 1 < n) hit = strstr(from, pat);
+        }
+        strcpy(o, from);
+        lineFree(line);
+        B->lines[y] = out;
+        lineChanged(B, y);
+        subs += n;
+        changed++;
+    }
+
+    if (changed) afterBulkEdit();
+    snprintf(statusmsg, sizeof(statusmsg), "[Command] %d substitutions on %d lines", subs, changed);
+}
+
+// g/pat/d deletes matching lines, v/pat/d the others, in one compaction pass
+void globalDelete(int first, int last, const char *arg, int invert) {
+    char delim = *arg++;
+    const char *end = strchr(arg, delim);
+    if (!end || strcmp(end + 1, "d") != 0 || end == arg) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Command] Usage: g/pattern/d");
+        return;
+    }
+    char pat[MAX_SEARCH_LEN];
+    snprintf(pat, sizeof(pat), "%.*s", (int)(end - arg), arg);
+
+    // the cached line counts follow the kept lines through from
+    int *from = malloc((B->num_lines + 1) * sizeof(int));
+    if (!from) die("malloc");
+    for (int y = 0; y < first; y++) from[y] = y;
+    int w = first;
+    for (int y = first; y <= last; y++) {
+        char *line = B->lines[y];
+        int hit = line && strstr(line, pat);
+        if (hit != invert) {
+            lineFree(line);
+            shiftMarks(B, w, -1);
+        } else {
+            from[w] = y;
+            B->lines[w++] = line;
+        }
+    }
+    int deleted = last + 1 - w;
+    memmove(&B->lines[w], &B->lines[last + 1], (B->num_lines - last - 1) * sizeof(char *));
+    for (int y = last + 1; y < B->num_lines; y++) from[y - deleted] = y;
+    for (int i = B->num_lines - deleted; i < B->num_lines; i++) B->lines[i] = NULL;
+    B->num_lines -= deleted;
+    if (deleted) linesRemapped(B, from, B->num_lines);
+    free(from);
+
+    if (deleted) afterBulkEdit();
+    snprintf(statusmsg, sizeof(statusmsg), "[Command] Deleted %d lines", deleted);
+}
+
+// moves the write position (y, off) on by n bytes of "line\n" records
+// sets each line's leading blanks from the bracket nesting, starting from the line above the range;
+// only the prefix is rewritten and lines already right are left alone
+void reindentLines(int first, int last) {
+    const char *unit = indentUnit(first);
+    int unit_len = strlen(unit);
+    int depth = 0;
+    for (int y = first - 1; y >= 0; y--) {
+        const char *line = B->lines[y];
+        if (!line) continue;
+        int lead = 0, width = 0;
+        for (; line[lead] == ' ' || line[lead] == '\t'; lead++) width += line[lead] == '\t' ? 4 - width % 4 : 1;
+        if (!line[lead]) continue;
+        depth = width / 4 + isClosingBracket(line[lead]) + lineBrackets(line).net;
+        if (depth < 0) depth = 0;
+        break;
+    }
+
+    int changed = 0;
+    for (int y = first; y <= last; y++) {
+        char *line = B->lines[y];
+        if (!line) continue;
+        int lead = 0;
+        while (line[lead] == ' ' || line[lead] == '\t') lead++;
+        int level = 0;
+        if (line[lead]) {
+            level = depth - isClosingBracket(line[lead]);
+            if (level < 0) level = 0;
+            depth += lineBrackets(line).net;
+            if (depth < 0) depth = 0;
+        }
+        int want = level * unit_len;
+        int same = lead == want;
+        for (int i = 0; same && i < lead; i++) same = line[i] == unit[i % unit_len];
+        if (same) continue;
+
+        // blanks hold no words or brackets, only the byte counts move
+        int len = strlen(line);
+        struct LineStats before = spanStats(line, 0, lead);
+        if (want > lead) line = lineRealloc(line, len - lead + want + 1);
+        memmove(&line[want], &line[lead], len - lead + 1);
+        for (int i = 0; i < want; i++) line[i] = unit[i % unit_len];
+        if (want < lead) line = lineRealloc(line, len - lead + want + 1);
+        B->lines[y] = line;
+        lineEdited(B, y, before, spanStats(line, 0, want));
+        if (y == B->cy) B->cx = B->cx > lead ? B->cx - lead + want : want;
+        changed++;
+    }
+
+    if (changed) {
+        B->num_matches = 0;
+        B->match_gen++;
+        clearCursors();
+        B->dirty = 1;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Reindent] %d of %d lines changed", changed, last - first + 1);
+}
+
+static void filterAdvance(int *y, int *off, ssize_t n) {
+    while (n > 0) {
+        int rest = (B->lines[*y] ? strlen(B->lines[*y]) : 0) + 1 - *off;
+        if (n < rest) {
+            *off += n;
+            return;
+        }
+        n -= rest;
+        (*y)++;
+        *off = 0;
+    }
+}
+
+// run the range through sh -c cmd and put its output in place of the range;
+// input is written and output read in the same poll loop so neither side can stall
+void filterLines(int first, int last, const char *cmd) {
+    int to_child[2], from_child[2];
+    if (pipe(to_child) == -1) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Filter] pipe failed");
+        return;
+    }
+    if (pipe(from_child) == -1) {
+        close(to_child[0]);
+        close(to_child[1]);
+        snprintf(statusmsg, sizeof(statusmsg), "[Filter] pipe failed");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        snprintf(statusmsg, sizeof(statusmsg), "[Filter] fork failed");
+        return;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        dup2(from_child[1], STDERR_FILENO);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    // its own process group, so stopping it reaches everything the command started
+    setpgid(pid, pid);
+    close(to_child[0]);
+    close(from_child[1]);
+    int in_fd = to_child[1], out_fd = from_child[0];
+    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+
+    // a command that exits without reading its input must not kill the editor
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    int y = first, off = 0; // next byte to send
+    if (y > last) {
+        close(in_fd);
+        in_fd = -1;
+    }
+    char **repl = NULL; // finished output lines, owned by the pool
+    int n = 0, cap = 0;
+    char *partial = NULL; // output line still being received
+    int partial_len = 0;
+    long long received = 0;
+    int cancelled = 0;
+    char chunk[READ_CHUNK];
+    struct timespec last_draw;
+    clock_gettime(CLOCK_MONOTONIC, &last_draw);
+
+    while (out_fd != -1) {
+        struct pollfd fds[3] = {
+            {out_fd, POLLIN, 0},
+            {STDIN_FILENO, POLLIN, 0},
+            {in_fd, POLLOUT, 0},
+        };
+        if (poll(fds, in_fd != -1 ? 3 : 2, 100) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (in_fd != -1 && (fds[2].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            // hand the kernel many lines at once straight from the buffer
+            struct iovec iov[512];
+            int k = 0;
+            for (int iy = y, ioff = off; iy <= last && k < 510; iy++, ioff = 0) {
+                char *line = B->lines[iy] ? B->lines[iy] : "";
+                int len = strlen(line);
+                if (ioff < len) iov[k++] = (struct iovec){line + ioff, len - ioff};
+                iov[k++] = (struct iovec){"\n", 1};
+            }
+            ssize_t w = writev(in_fd, iov, k);
+            if (w > 0) filterAdvance(&y, &off, w);
+            if ((w == -1 && errno != EAGAIN && errno != EINTR) || y > last) {
+                close(in_fd);
+                in_fd = -1;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = read(out_fd, chunk, sizeof(chunk));
+            if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+                close(out_fd);
+                out_fd = -1;
+            }
+            // split into lines as it arrives, appending to the pool line directly
+            for (ssize_t i = 0; i < r;) {
+                char *nl = memchr(chunk + i, '\n', r - i);
+                int seg = nl ? nl - (chunk + i) : r - i;
+                partial = lineRealloc(partial, partial_len + seg + 1);
+                memcpy(partial + partial_len, chunk + i, seg);
+                partial_len += seg;
+                partial[partial_len] = '\0';
+                i += seg;
+                if (nl) {
+                    if (n == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        repl = realloc(repl, cap * sizeof(char *));
+                        if (!repl) die("realloc");
+                    }
+                    repl[n++] = partial;
+                    partial = NULL;
+                    partial_len = 0;
+                    i++;
+                }
+            }
+            if (r > 0) received += r;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            // Esc stops the command, other keys wait until it is done
+            int c = readTerminalKey();
+            if (c == '\x1b') {
+                cancelled = 1;
+                break;
+            }
+            if (c && num_pending_keys < (int)(sizeof(pending_keys) / sizeof(pending_keys[0]))) {
+                pending_keys[num_pending_keys++] = c;
+            }
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last_draw.tv_sec) * 1000 + (now.tv_nsec - last_draw.tv_nsec) / 1000000 >= 100) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Filter] %d/%d in, %d out, %d KB, Esc stops",
+                     y - first, last - first + 1, n, (int)(received / 1024));
+            editorRefreshScreen();
+            last_draw = now;
+        }
+    }
+
+    if (in_fd != -1) close(in_fd);
+    if (out_fd != -1) close(out_fd);
+    int status = 0;
+    if (cancelled) {
+        // give it half a second to exit on SIGTERM, then kill whatever is left of the group
+        kill(-pid, SIGTERM);
+        int reaped = 0;
+        for (int i = 0; i < 50 && !reaped; i++) {
+            reaped = waitpid(pid, &status, WNOHANG) == pid;
+            if (!reaped) poll(NULL, 0, 10);
+        }
+        kill(-pid, SIGKILL);
+        if (!reaped) waitpid(pid, &status, 0);
+    } else {
+        waitpid(pid, &status, 0);
+    }
+    signal(SIGPIPE, old_pipe);
+
+    if (partial && !cancelled) {
+        if (n == cap) {
+            repl = realloc(repl, (cap + 1) * sizeof(char *));
+            if (!repl) die("realloc");
+        }
+        repl[n++] = partial;
+        partial = NULL;
+    }
+    lineFree(partial);
+
+    if (cancelled) {
+        for (int i = 0; i < n; i++) lineFree(repl[i]);
+        free(repl);
+        snprintf(statusmsg, sizeof(statusmsg), "[Filter] Cancelled, buffer unchanged");
+        return;
+    }
+
+    replaceLines(first, last - first + 1, repl, n);
+    free(repl);
+    afterBulkEdit();
+    snprintf(statusmsg, sizeof(statusmsg), "[Filter] %d lines filtered into %d, exit %d",
+             last - first + 1, n, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+/*** JSON Functions ***/
+
+// x ^= x << 1 and so on: bit i becomes the parity of bits 0 .. i
+static uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// one bit per byte for quotes, backslashes and { } [ ] : ,
+static void jsonMasks(const char *p, int n, uint64_t *quote, uint64_t *bslash, uint64_t *op) {
+    *quote = *bslash = *op = 0;
+#ifdef __SSE2__
+    if (n == 64) {
+        // { and [ differ from } and ] only in bit 5 (0x20), so two compares cover all four
+        __m128i q = _mm_set1_epi8('"'), b = _mm_set1_epi8('\\'), case_bit = _mm_set1_epi8(0x20);
+        __m128i open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+        __m128i colon = _mm_set1_epi8(':'), comma = _mm_set1_epi8(',');
+        for (int i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i folded = _mm_or_si128(v, case_bit);
+            __m128i ops = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+            *quote |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (16 * i);
+            *bslash |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b)) << (16 * i);
+            *op |= (uint64_t)_mm_movemask_epi8(ops) << (16 * i);
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        char c = p[i];
+        if (c == '"') *quote |= 1ULL << i;
+        else if (c == '\\') *bslash |= 1ULL << i;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') *op |= 1ULL << i;
+    }
+}
+
+// structural characters of the next 64 bytes, with no branches per byte: quotes escaped by
+// an odd run of backslashes are dropped, then a prefix xor of the quotes masks string contents
+static uint64_t jsonBlock(struct JsonScan *s, const char *p, int n) {
+    uint64_t quote, bslash, op;
+    jsonMasks(p, n, &quote, &bslash, &op);
+
+    const uint64_t even = 0x5555555555555555ULL;
+    bslash &= ~s->escaped;
+    uint64_t follows = bslash << 1 | s->escaped;
+    uint64_t odd_starts = bslash & ~even & ~follows;
+    uint64_t even_runs;
+    s->escaped = __builtin_add_overflow(odd_starts, bslash, &even_runs);
+    uint64_t escaped = (even ^ (even_runs << 1)) & follows;
+
+    quote &= ~escaped;
+    uint64_t inside = prefixXor(quote) ^ s->in_string;
+    s->in_string = (uint64_t)((int64_t)inside >> 63);
+    return op & ~inside;
+}
+
+// JSON strings cannot hold a raw newline, so each line is scanned on its own
+static void jsonStart(struct JsonScan *s, const char *line) {
+    s->line = line ? line : "";
+    s->len = strlen(s->line);
+    s->base = 0;
+    s->bits = 0;
+    s->in_string = 0;
+    s->escaped = 0;
+}
+
+// position of the next structural character in the line, -1 at its end
+static int jsonNext(struct JsonScan *s) {
+    while (!s->bits) {
+        if (s->base >= s->len) return -1;
+        int n = s->len - s->base < 64 ? s->len - s->base : 64;
+        s->bits = jsonBlock(s, s->line + s->base, n);
+        s->base += 64;
+    }
+    int pos = s->base - 64 + __builtin_ctzll(s->bits);
+    s->bits &= s->bits - 1;
+    return pos;
+}
+
+static int isJsonOpen(char c) {
+    return c == '{' || c == '[';
+}
+
+static int isJsonClose(char c) {
+    return c == '}' || c == ']';
+}
+
+// appends to the line being built, which grows in place and becomes a buffer line as is
+static void jsonEmit(struct JsonOut *o, const char *s, int n) {
+    if (o->len + n + 1 > o->cur_cap) {
+        while (o->len + n + 1 > o->cur_cap) o->cur_cap *= 2;
+        o->cur = lineRealloc(o->cur, o->cur_cap);
+    }
+    memcpy(o->cur + o->len, s, n);
+    o->len += n;
+}
+
+static void jsonNewline(struct JsonOut *o, int indent) {
+    if (o->n == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 1024;
+        o->lines = realloc(o->lines, o->cap * sizeof(char *));
+        if (!o->lines) die("realloc");
+    }
+    o->cur[o->len] = '\0';
+    if (o->len >= 4096) {
+        // a long line is handed over as it is, a minified file is never copied
+        o->lines[o->n++] = lineRealloc(o->cur, o->len + 1);
+        o->cur_cap = 64;
+        o->cur = lineAlloc(o->cur_cap);
+    } else {
+        // short lines are copied out so each gets a block of its own size
+        char *line = lineAlloc(o->len + 1);
+        memcpy(line, o->cur, o->len + 1);
+        o->lines[o->n++] = line;
+    }
+    o->len = 0;
+    for (int i = 0; i < indent; i++) jsonEmit(o, o->unit, o->unit_len);
+}
+
+// a whole string with no unescaped quote inside
+static int isJsonString(const char *s, int n) {
+    if (n < 2 || s[0] != '"' || s[n - 1] != '"') return 0;
+    for (int i = 1; i < n - 1; i++) {
+        if (s[i] == '"') return 0;
+        if (s[i] == '\\' && ++i == n - 1) return 0; // the closing quote is escaped
+    }
+    return 1;
+}
+
+static int isJsonScalar(const char *s, int n) {
+    if (*s == '"') return isJsonString(s, n);
+    if ((n == 4 && memcmp(s, "true", 4) == 0) || (n == 5 && memcmp(s, "false", 5) == 0) ||
+        (n == 4 && memcmp(s, "null", 4) == 0)) {
+        return 1;
+    }
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    int i = 0;
+    if (i < n && s[i] == '-') i++;
+    if (i < n && s[i] == '0') {
+        i++;
+    } else {
+        if (i >= n || !isdigit((unsigned char)s[i])) return 0;
+        while (i < n && isdigit((unsigned char)s[i])) i++;
+    }
+    if (i < n && s[i] == '.') {
+        if (++i >= n || !isdigit((unsigned char)s[i])) return 0;
+        while (i < n && isdigit((unsigned char)s[i])) i++;
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        i++;
+        if (i < n && (s[i] == '+' || s[i] == '-')) i++;
+        if (i >= n || !isdigit((unsigned char)s[i])) return 0;
+        while (i < n && isdigit((unsigned char)s[i])) i++;
+    }
+    return i == n;
+}
+
+// the container takes a comma next, top level values just follow each other
+static void jsonValueDone(struct JsonOut *o) {
+    o->want = o->depth > 0 ? JSON_COMMA : JSON_VALUE;
+}
+
+// starts the line a value or opener goes on
+static void jsonPlace(struct JsonOut *o) {
+    if (o->open && o->pretty) jsonNewline(o, o->depth);
+    else if (o->depth == 0 && o->len > 0) jsonNewline(o, 0); // JSON lines: one value per line
+    o->open = 0;
+}
+
+// a scalar or key, the text between two structural characters with the blanks around it
+// dropped; -1 if it is not one or does not belong there
+static int jsonValue(struct JsonOut *o, const char *s, int n) {
+    while (n > 0 && isspace((unsigned char)*s)) s++, n--;
+    while (n > 0 && isspace((unsigned char)s[n - 1])) n--;
+    if (n == 0) return 0;
+    if (o->want == JSON_KEY) {
+        if (!isJsonString(s, n)) return -1;
+        o->want = JSON_COLON;
+    } else if (o->want == JSON_VALUE) {
+        if (!isJsonScalar(s, n)) return -1;
+        jsonValueDone(o);
+    } else {
+        return -1;
+    }
+    jsonPlace(o);
+    jsonEmit(o, s, n);
+    return 0;
+}
+
+static int jsonToken(struct JsonOut *o, char c) {
+    if (isJsonOpen(c)) {
+        if (o->want != JSON_VALUE) return -1;
+        jsonPlace(o);
+        jsonEmit(o, &c, 1);
+        if (o->depth == o->stack_cap) {
+            o->stack_cap = o->stack_cap ? o->stack_cap * 2 : 64;
+            o->stack = realloc(o->stack, o->stack_cap);
+            if (!o->stack) die("realloc");
+        }
+        o->stack[o->depth++] = c;
+        o->open = 1;
+        o->want = c == '{' ? JSON_KEY : JSON_VALUE;
+    } else if (isJsonClose(c)) {
+        if (o->depth == 0 || o->stack[o->depth - 1] != (c == '}' ? '{' : '[')) return -1;
+        if (o->want != JSON_COMMA && !(o->open && o->want == (c == '}' ? JSON_KEY : JSON_VALUE))) return -1;
+        o->depth--;
+        if (!o->open && o->pretty) jsonNewline(o, o->depth);
+        o->open = 0;
+        jsonEmit(o, &c, 1);
+        jsonValueDone(o);
+    } else if (c == ',') {
+        if (o->want != JSON_COMMA) return -1;
+        o->want = o->stack[o->depth - 1] == '{' ? JSON_KEY : JSON_VALUE;
+        jsonEmit(o, ",", 1);
+        if (o->pretty) jsonNewline(o, o->depth);
+    } else {
+        if (o->want != JSON_COLON) return -1;
+        o->want = JSON_VALUE;
+        jsonEmit(o, o->pretty ? ": " : ":", o->pretty ? 2 : 1);
+    }
+    return 0;
+}
+
+// rewrites lines first .. last as indented JSON, or as compact JSON when pretty is 0;
+// output goes straight into new buffer lines, the old ones are only dropped once it is valid
+void formatJson(int first, int last, int pretty) {
+    const char *unit = indentUnit(first);
+    struct JsonOut o = {0};
+    o.pretty = pretty;
+    o.unit = unit;
+    o.unit_len = strlen(unit);
+    o.cur_cap = 64;
+    o.cur = lineAlloc(o.cur_cap);
+
+    int bad = -1;
+    for (int y = first; y <= last && bad < 0; y++) {
+        struct JsonScan s;
+        jsonStart(&s, B->lines[y]);
+        int prev = 0, pos;
+        while ((pos = jsonNext(&s)) >= 0) {
+            if (jsonValue(&o, s.line + prev, pos - prev) < 0 || jsonToken(&o, s.line[pos]) < 0) {
+                bad = y;
+                break;
+            }
+            prev = pos + 1;
+        }
+        if (bad < 0 && jsonValue(&o, s.line + prev, s.len - prev) < 0) bad = y;
+        if (s.in_string) bad = y;
+    }
+    if (bad < 0 && o.depth > 0) bad = last;
+
+    if (bad >= 0) {
+        for (int i = 0; i < o.n; i++) lineFree(o.lines[i]);
+        lineFree(o.cur);
+        snprintf(statusmsg, sizeof(statusmsg), "[JSON] Not valid JSON at line %d, nothing changed", bad + 1);
+    } else {
+        if (o.len > 0 || o.n == 0) jsonNewline(&o, 0);
+        lineFree(o.cur);
+        int count = last - first + 1;
+        replaceLines(first, count, o.lines, o.n);
+        if (B->cy >= first) B->cy = first;
+        B->cx = 0;
+        afterBulkEdit();
+        snprintf(statusmsg, sizeof(statusmsg), "[JSON] %d lines %s into %d", count,
+                 pretty ? "formatted" : "minified", o.n);
+    }
+    free(o.lines);
+    free(o.stack);
+}
+
+// first non-blank at or after (*y, *x), across lines
+static int jsonSkipBlank(int *y, int *x) {
+    for (; *y < B->num_lines; (*y)++, *x = 0) {
+        const char *line = B->lines[*y] ? B->lines[*y] : "";
+        while (line[*x] && isspace((unsigned char)line[*x])) (*x)++;
+        if (line[*x]) return 1;
+    }
+    return 0;
+}
+
+// the { or [ holding the element at (y, x); 0 if it is at the top level
+static int jsonParent(int y, int x, int *py, int *px) {
+    int need = 0; // closers between here and the cursor, each hides one opener
+    int *stack = NULL, cap = 0;
+    for (; y >= 0; y--, x = -1) {
+        struct JsonScan s;
+        jsonStart(&s, B->lines[y]);
+        int n = 0, closers = 0, pos;
+        while ((pos = jsonNext(&s)) >= 0 && (x < 0 || pos < x)) {
+            char c = s.line[pos];
+            if (isJsonOpen(c)) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    stack = realloc(stack, cap * sizeof(int));
+                    if (!stack) die("realloc");
+                }
+                stack[n++] = pos;
+            } else if (isJsonClose(c)) {
+                if (n > 0) n--;
+                else closers++;
+            }
+        }
+        if (n > need) {
+            *py = y;
+            *px = stack[n - 1 - need];
+            free(stack);
+            return 1;
+        }
+        need += closers - n;
+    }
+    free(stack);
+    return 0;
+}
+
+// :json up, :json next and :json prev move between elements the way the structure nests them
+void jsonNavigate(const char *dir) {
+    int y = B->cy, x = B->cx;
+    if (strcmp(dir, "up") == 0) {
+        if (!jsonParent(B->cy, B->cx, &y, &x)) {
+            snprintf(statusmsg, sizeof(statusmsg), "[JSON] Already at the top level");
+            return;
+        }
+    } else if (strcmp(dir, "next") == 0) {
+        // the comma that ends this element at its own depth, then what follows it
+        int depth = 0, found = 0;
+        for (; y < B->num_lines; y++, x = 0) {
+            struct JsonScan s;
+            jsonStart(&s, B->lines[y]);
+            int pos;
+            while ((pos = jsonNext(&s)) >= 0) {
+                if (pos < x) continue;
+                char c = s.line[pos];
+                if (isJsonOpen(c)) {
+                    depth++;
+                } else if (isJsonClose(c)) {
+                    if (depth-- == 0) break; // the end of the parent, this was the last element
+                } else if (c == ',' && depth == 0) {
+                    found = 1;
+                    x = pos + 1;
+                    break;
+                }
+            }
+            if (found || depth < 0) break;
+        }
+        if (!found || !jsonSkipBlank(&y, &x)) {
+            snprintf(statusmsg, sizeof(statusmsg), "[JSON] No next element");
+            return;
+        }
+    } else if (strcmp(dir, "prev") == 0) {
+        // the last two commas at this depth between the parent and the cursor
+        int top = 0, left = 0;
+        if (jsonParent(B->cy, B->cx, &top, &left)) left++;
+        int cy[2] = {-1, -1}, cx[2] = {0, 0}, depth = 0;
+        for (int i = top; i <= B->cy; i++) {
+            struct JsonScan s;
+            jsonStart(&s, B->lines[i]);
+            int pos;
+            while ((pos = jsonNext(&s)) >= 0 && (i < B->cy || pos < B->cx)) {
+                if (i == top && pos < left) continue;
+                char c = s.line[pos];
+                if (isJsonOpen(c)) depth++;
+                else if (isJsonClose(c)) depth--;
+                else if (c == ',' && depth == 0) {
+                    cy[1] = cy[0], cx[1] = cx[0];
+                    cy[0] = i, cx[0] = pos + 1;
+                }
+            }
+        }
+        if (cy[0] < 0) {
+            snprintf(statusmsg, sizeof(statusmsg), "[JSON] No previous element");
+            return;
+        }
+        y = cy[1] >= 0 ? cy[1] : top;
+        x = cy[1] >= 0 ? cx[1] : left;
+        jsonSkipBlank(&y, &x);
+    } else {
+        snprintf(statusmsg, sizeof(statusmsg), "[JSON] Unknown: %.40s", dir);
+        return;
+    }
+    B->cy = y;
+    B->cx = x;
+    revealLine(y);
+    scrollToCursor();
+}
+
+/*** Sort Functions ***/
+
+static int sortCompare(const struct SortRec *a, const struct SortRec *b, int numeric, int reverse) {
+    if (a->prefix != b->prefix) return a->prefix < b->prefix ? -1 : 1;
+    if (numeric) return 0;
+
+    // same first 8 bytes, the rest of the key decides
+    int r = 0;
+    int n = a->len < b->len ? a->len : b->len;
+    if (n > 8) r = memcmp(a->line + a->off + 8, b->line + b->off + 8, n - 8);
+    if (r == 0) r = (a->len > b->len) - (a->len < b->len);
+    return reverse ? -r : r;
+}
+
+// cells is the line's field table in the column view, the key is then just that field
+static void sortKey(struct SortRec *r, char *line, int numeric, int reverse, int field, const int *cells) {
+    const char *k = line ? line : "";
+    r->line = line;
+    if (cells) {
+        int f = field <= cells[0] ? field : cells[0] + 1;
+        r->off = f <= cells[0] ? cells[f] : cells[cells[0] + 1] - 1;
+        r->len = f <= cells[0] ? cells[f + 1] - 1 - r->off : 0;
+        k += r->off;
+    } else {
+        // skip field - 1 blank separated fields
+        for (int f = 1; f < field && *k; f++) {
+            while (*k == ' ' || *k == '\t') k++;
+            while (*k && *k != ' ' && *k != '\t') k++;
+        }
+        r->off = line ? k - line : 0;
+        r->len = strlen(k);
+    }
+
+    uint64_t v = 0;
+    if (numeric) {
+        // order preserving bits of the double, lines without a number go first
+        char *end;
+        double d = strtod(k, &end);
+        if (end != k) {
+            memcpy(&v, &d, sizeof(v));
+            v = (v >> 63) ? ~v : v | (1ULL << 63);
+        }
+    } else {
+        for (int i = 0; i < 8; i++) {
+            v <<= 8;
+            if (i < r->len) v |= (unsigned char)k[i];
+        }
+    }
+    r->prefix = reverse ? ~v : v;
+}
+
+static void mergeRuns(struct SortRec *src, struct SortRec *dst, int lo, int mid, int hi,
+                      int numeric, int reverse) {
+    int i = lo, j = mid, o = lo;
+    while (i < mid && j < hi) {
+        // <= keeps equal keys in their original order
+        if (sortCompare(&src[i], &src[j], numeric, reverse) <= 0) dst[o++] = src[i++];
+        else dst[o++] = src[j++];
+    }
+    memcpy(&dst[o], &src[i], (mid - i) * sizeof(struct SortRec));
+    o += mid - i;
+    memcpy(&dst[o], &src[j], (hi - j) * sizeof(struct SortRec));
+}
+
+// LSD radix on the prefix, passes where every record has the same byte are skipped
+static struct SortRec *radixSort(struct SortRec *a, struct SortRec *tmp, int n) {
+    for (int shift = 0; shift < 64; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; i++) count[((a[i].prefix >> shift) & 0xff) + 1]++;
+        if (count[((a[0].prefix >> shift) & 0xff) + 1] == n) continue;
+        for (int b = 0; b < 256; b++) count[b + 1] += count[b];
+        for (int i = 0; i < n; i++) tmp[count[(a[i].prefix >> shift) & 0xff]++] = a[i];
+        struct SortRec *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    return a;
+}
+
+// builds the records for [lo, hi) and sorts them, radix when the prefix is the whole key
+static void *sortChunk(void *arg) {
+    struct SortJob *job = arg;
+    struct SortRec *a = job->a + job->lo, *tmp = job->tmp + job->lo;
+    int n = job->hi - job->lo;
+    int short_keys = 1;
+    for (int i = 0; i < n; i++) {
+        int y = job->first + job->lo + i;
+        const int *cells = B->csv_delim && job->lines[job->lo + i] ? csvCells(B, y) : NULL;
+        sortKey(&a[i], job->lines[job->lo + i], job->numeric, job->reverse, job->field, cells);
+        if (a[i].len > 8) short_keys = 0;
+    }
+
+    struct SortRec *out;
+    if (n > 0 && (job->numeric || short_keys)) {
+        out = radixSort(a, tmp, n);
+    } else {
+        // bottom-up merge sort, ping-ponging between a and tmp
+        struct SortRec *src = a, *dst = tmp;
+        for (int w = 1; w < n; w *= 2) {
+            for (int lo = 0; lo < n; lo += 2 * w) {
+                int mid = lo + w < n ? lo + w : n;
+                int hi = lo + 2 * w < n ? lo + 2 * w : n;
+                mergeRuns(src, dst, lo, mid, hi, job->numeric, job->reverse);
+            }
+            struct SortRec *t = src;
+            src = dst;
+            dst = t;
+        }
+        out = src;
+    }
+    if (out != a) memcpy(a, out, n * sizeof(struct SortRec));
+    return NULL;
+}
+
+static void *mergeJob(void *arg) {
+    struct SortJob *job = arg;
+    mergeRuns(job->a, job->tmp, job->lo, job->mid, job->hi, job->numeric, job->reverse);
+    return NULL;
+}
+
+// :sort [n][r][u][k N] - numeric, reverse, unique, key from field N
+void sortLines(int first, int last, const char *opts) {
+    int n = last - first + 1;
+    if (n <= 1) return;
+
+    int numeric = 0, reverse = 0, unique = 0, field = 1;
+    for (const char *o = opts; *o; o++) {
+        if (*o == 'n') numeric = 1;
+        else if (*o == 'r') reverse = 1;
+        else if (*o == 'u') unique = 1;
+        else if (*o == 'k') field = atoi(o + 1) > 0 ? atoi(o + 1) : 1;
+    }
+
+    struct SortRec *a = malloc(n * sizeof(struct SortRec));
+    struct SortRec *tmp = malloc(n * sizeof(struct SortRec));
+    if (!a || !tmp) die("malloc");
+    // size the field tables here, the threads then only fill in their own lines
+    if (B->csv_delim && B->csv_n != B->num_lines) csvReset(B);
+
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > SORT_MAX_THREADS) threads = SORT_MAX_THREADS;
+    if (threads > n / SORT_MIN_CHUNK) threads = n / SORT_MIN_CHUNK;
+    if (threads < 1) threads = 1;
+
+    // each thread sorts a slice, then slices are merged pairwise in parallel rounds
+    struct SortJob jobs[SORT_MAX_THREADS];
+    pthread_t tids[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS]; // a job whose thread could not start ran inline instead
+    int bounds[SORT_MAX_THREADS + 1];
+    for (int t = 0; t <= threads; t++) bounds[t] = (int)((long long)n * t / threads);
+    for (int t = 0; t < threads; t++) {
+        jobs[t] = (struct SortJob){a, tmp, bounds[t], 0, bounds[t + 1], numeric, reverse, field,
+                                   &B->lines[first], first};
+        started[t] = t > 0 && pthread_create(&tids[t], NULL, sortChunk, &jobs[t]) == 0;
+        if (t > 0 && !started[t]) sortChunk(&jobs[t]);
+    }
+    sortChunk(&jobs[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(tids[t], NULL);
+    }
+
+    struct SortRec *src = a, *dst = tmp;
+    for (int w = 1; w < threads; w *= 2) {
+        int k = 0;
+        for (int t = 0; t < threads; t += 2 * w) {
+            int mid = t + w < threads ? t + w : threads;
+            int hi = t + 2 * w < threads ? t + 2 * w : threads;
+            jobs[k] = (struct SortJob){src, dst, bounds[t], bounds[mid], bounds[hi], numeric, reverse,
+                                       field, NULL, 0};
+            started[k] = pthread_create(&tids[k], NULL, mergeJob, &jobs[k]) == 0;
+            if (!started[k]) mergeJob(&jobs[k]);
+            k++;
+        }
+        for (int i = 0; i < k; i++) {
+            if (started[i]) pthread_join(tids[i], NULL);
+        }
+        struct SortRec *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    // swap the line handles into place, dropping repeats for u
+    int w = first;
+    for (int i = 0; i < n; i++) {
+        if (unique && i > 0 && sortCompare(&src[i - 1], &src[i], numeric, reverse) == 0) {
+            lineFree(src[i].line);
+            continue;
+        }
+        B->lines[w++] = src[i].line;
+    }
+    int dropped = last + 1 - w;
+    memmove(&B->lines[w], &B->lines[last + 1], (B->num_lines - last - 1) * sizeof(char *));
+    for (int i = B->num_lines - dropped; i < B->num_lines; i++) B->lines[i] = NULL;
+    B->num_lines -= dropped;
+    linesReplaced(B, first, n, n - dropped);
+    if (dropped) shiftMarks(B, first + n - dropped, -dropped);
+
+    free(a);
+    free(tmp);
+    afterBulkEdit();
+    snprintf(statusmsg, sizeof(statusmsg), "[Command] Sorted %d lines, %d duplicates removed", n, dropped);
+}
+
+void saveFile(const char *filename) {
+    if (B->scratch) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't save! %s is not a file.", filename);
+        return;
+    }
+    if (hex_view) {
+        saveHexPatches();
+        return;
+    }
+    if (B->binary) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't save! %.40s is binary, use :hex", filename);
+        return;
+    }
+    if (B->large) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't save! %.40s is only open in the pager", filename);
+        return;
+    }
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't save! fopen error.");
+        return;
+    }
+
+    for (int i = 0; i < B->num_lines; i++) {
+        if (B->lines[i]) {
+            fprintf(file, "%s\n", B->lines[i]);
+        }
+    }
+
+    // the file on disk now matches the buffer, so follow mode resumes from here
+    B->file_size = ftell(file);
+    B->tail_open = 0;
+    B->dirty = 0;
+    fclose(file);
+    pollWatch(); // swallow the change events caused by our own write
+    snprintf(statusmsg, sizeof(statusmsg), "[Saved to %s]", filename);
+}
+
+void ensureLineCapacity(int n) {
+    if (n <= B->lines_cap) return;
+
+    int new_cap = B->lines_cap ? B->lines_cap * 2 : 64;
+    while (new_cap < n) new_cap *= 2;
+    B->lines = realloc(B->lines, new_cap * sizeof(char *));
+    if (!B->lines) die("realloc");
+    memset(&B->lines[B->lines_cap], 0, (new_cap - B->lines_cap) * sizeof(char *));
+    B->lines_cap = new_cap;
+}
+
+void freeLines() {
+    for (int i = 0; i < B->lines_cap; i++) {
+        lineFree(B->lines[i]);
+        B->lines[i] = NULL;
+    }
+    B->num_lines = 0;
+}
+
+void loadFile(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        file = fopen(filename, "w");
+        if (!file) {
+            die("fopen");
+        }
+        fclose(file);
+        return;
+    }
+
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t nread;
+
+    // drop whatever was loaded before instead of leaking it
+    freeLines();
+    clearCursors();
+    B->file_size = 0;
+    B->tail_open = 0;
+    B->dirty = 0;
+    statsInvalidate(B);
+
+    // binary files almost always have a NUL near the start, they go to the hex view unread
+    char head[4096];
+    size_t head_len = fread(head, 1, sizeof(head), file);
+    B->binary = memchr(head, '\0', head_len) != NULL;
+    if (B->binary) {
+        fclose(file);
+        return;
+    }
+    // reading this much into lines would take seconds and gigabytes, it goes to the pager
+    struct stat st;
+    B->large = fstat(fileno(file), &st) == 0 && st.st_size >= PAGER_MIN_SIZE;
+    if (B->large) {
+        fclose(file);
+        return;
+    }
+    rewind(file);
+    while ((nread = getline(&line, &len, file)) != -1) {
+        B->file_size += nread;
+        B->tail_open = line[nread - 1] != '\n';
+        line[strcspn(line, "\n")] = 0;
+        ensureLineCapacity(B->num_lines + 1);
+        B->lines[B->num_lines] = lineAlloc(strlen(line) + 1);
+        strcpy(B->lines[B->num_lines], line);
+        B->num_lines++;
+    }
+
+    free(line);
+    fclose(file);
+    startWordIndex(B);
+}
+
+/*** Memory Pool Functions ***/
+
+// every block starts with its size class so free and realloc know where it goes
+struct PoolHeader {
+    size_t cls;
+};
+
+struct PoolFree {
+    struct PoolFree *next;
+};
+
+struct PoolFree *pool_free[POOL_CLASSES];
+char *pool_slab; // current slab blocks are carved from
+size_t pool_slab_left;
+
+static size_t poolClassSize(size_t cls) {
+    return (size_t)16 << cls;
+}
+
+void *lineAlloc(size_t n) {
+    size_t need = n + sizeof(struct PoolHeader);
+    size_t cls = 0;
+    while (cls < POOL_CLASSES && poolClassSize(cls) < need) cls++;
+
+    struct PoolHeader *h;
+    if (cls == POOL_CLASSES) {
+        h = malloc(need);
+        if (!h) die("malloc");
+    } else if (pool_free[cls]) {
+        h = (struct PoolHeader *)pool_free[cls];
+        pool_free[cls] = pool_free[cls]->next;
+    } else {
+        if (pool_slab_left < poolClassSize(cls)) {
+            // the tail of the old slab is simply dropped, it is smaller than 4 KB
+            pool_slab = malloc(POOL_SLAB);
+            if (!pool_slab) die("malloc");
+            pool_slab_left = POOL_SLAB;
+        }
+        h = (struct PoolHeader *)pool_slab;
+        pool_slab += poolClassSize(cls);
+        pool_slab_left -= poolClassSize(cls);
+    }
+    h->cls = cls;
+    return h + 1;
+}
+
+void *lineRealloc(void *p, size_t n) {
+    if (!p) return lineAlloc(n);
+
+    struct PoolHeader *h = (struct PoolHeader *)p - 1;
+    size_t need = n + sizeof(struct PoolHeader);
+    if (h->cls == POOL_CLASSES) {
+        h = realloc(h, need);
+        if (!h) die("realloc");
+        return h + 1;
+    }
+    // anything that still fits the block is free, which is most single-char edits
+    if (need <= poolClassSize(h->cls)) return p;
+
+    void *q = lineAlloc(n);
+    size_t old = poolClassSize(h->cls) - sizeof(struct PoolHeader);
+    memcpy(q, p, old < n ? old : n);
+    lineFree(p);
+    return q;
+}
+
+void lineFree(void *p) {
+    if (!p) return;
+
+    struct PoolHeader *h = (struct PoolHeader *)p - 1;
+    size_t cls = h->cls;
+    if (cls == POOL_CLASSES) {
+        free(h);
+        return;
+    }
+    // the free list link overwrites the header
+    struct PoolFree *f = (struct PoolFree *)h;
+    f->next = pool_free[cls];
+    pool_free[cls] = f;
+}
+
+/*** Buffer Functions ***/
+
+struct Buffer *newBuffer(const char *filename) {
+    struct Buffer *b = calloc(1, sizeof(struct Buffer));
+    if (!b) die("calloc");
+    b->filename = filename;
+    b->watch_wd = -1;
+    b->stats_n = -1; // nothing counted yet
+
+    buffers = realloc(buffers, (num_buffers + 1) * sizeof(struct Buffer *));
+    buffers[num_buffers++] = b;
+    return b;
+}
+
+// find the buffer already holding filename, or load it into a new one
+struct Buffer *openBuffer(const char *filename) {
+    for (int i = 0; i < num_buffers; i++) {
+        if (!buffers[i]->scratch && strcmp(buffers[i]->filename, filename) == 0) return buffers[i];
+    }
+
+    struct Buffer *prev = B;
+    B = newBuffer(strdup(filename));
+    loadFile(B->filename);
+    startWatch(B->filename);
+    struct Buffer *b = B;
+    B = prev;
+    return b;
+}
+
+// put b in the active pane
+// returns 0 when unsaved hex bytes keep the current buffer up
+int showBuffer(struct Buffer *b) {
+    if (b != B && hex_view) {
+        // the hex patches belong to this file, they must not be written into the next one
+        if (hex_num_patches > 0) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Hex] %d unsaved bytes, Ctrl-S writes, Esc drops them",
+                     hex_num_patches);
+            return 0;
+        }
+        exitHexView();
+    }
+    if (b != B) exitPagerView();
+    B = b;
+    for (int i = 0; i < num_buffers; i++) {
+        if (buffers[i] == b) current_buffer = i;
+    }
+    active_pane->buf = B;
+    active_pane->damaged = 1;
+    visual_mode = 0;
+    if (B->binary && !hex_view) enterHexView();
+    if (B->large && !pager_view) enterPagerView();
+    return 1;
+}
+
+void switchBuffer(int dir) {
+    if (num_buffers < 2) return;
+
+    if (!showBuffer(buffers[(current_buffer + dir + num_buffers) % num_buffers])) return;
+    snprintf(statusmsg, sizeof(statusmsg), "[Buffer %d/%d] %s", current_buffer + 1, num_buffers, B->filename);
+}
+
+/*** Pane Functions ***/
+
+struct Pane *newPane(struct Buffer *buf) {
+    struct Pane *p = calloc(1, sizeof(struct Pane));
+    if (!p) die("calloc");
+    p->buf = buf;
+    p->hl_gen = -1;
+    return p;
+}
+
+void layoutPanes(struct Pane *p, int top, int left, int rows, int cols) {
+    p->top = top;
+    p->left = left;
+    p->rows = rows;
+    p->cols = cols;
+    p->damaged = 1;
+    if (p->split == 'h') {
+        // one row between the halves for the separator
+        int first = (rows - 1) / 2;
+        layoutPanes(p->first, top, left, first, cols);
+        layoutPanes(p->second, top + first + 1, left, rows - first - 1, cols);
+    } else if (p->split == 'v') {
+        int first = (cols - 1) / 2;
+        layoutPanes(p->first, top, left, rows, first);
+        layoutPanes(p->second, top, left + first + 1, rows, cols - first - 1);
+    }
+}
+
+// park the active viewport in its pane so the pane can be drawn or left
+static void saveViewport() {
+    active_pane->cx = B->cx;
+    active_pane->cy = B->cy;
+    active_pane->rowoff = B->rowoff;
+}
+
+// make p active without saving the old active pane, which may be gone
+static void loadPane(struct Pane *p) {
+    active_pane = p;
+    B = p->buf;
+    B->cx = p->cx;
+    B->cy = p->cy;
+    B->rowoff = p->rowoff;
+    editor_rows = p->rows;
+    editor_cols = p->cols;
+    scrollToCursor();
+    for (int i = 0; i < num_buffers; i++) {
+        if (buffers[i] == B) current_buffer = i;
+    }
+    visual_mode = 0;
+}
+
+void activatePane(struct Pane *p) {
+    saveViewport();
+    loadPane(p);
+}
+
+void splitPane(int dir) {
+    if ((dir == 'h' && active_pane->rows < 3) || (dir == 'v' && active_pane->cols < 3)) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't split! Not enough room.");
+        return;
+    }
+
+    // the leaf turns into a split node holding two views of the same buffer
+    saveViewport();
+    struct Pane *p = active_pane;
+    struct Pane *a = newPane(p->buf);
+    struct Pane *b = newPane(p->buf);
+    a->cx = b->cx = p->cx;
+    a->cy = b->cy = p->cy;
+    a->rowoff = b->rowoff = p->rowoff;
+    a->parent = b->parent = p;
+    free(p->hl_first);
+    p->hl_first = NULL;
+    p->split = dir;
+    p->first = a;
+    p->second = b;
+    p->buf = NULL;
+
+    layoutPanes(root_pane, 0, 0, screen_rows, screen_cols);
+    loadPane(a);
+    full_redraw = 1;
+    snprintf(statusmsg, sizeof(statusmsg), "[Split] Ctrl-W w next pane, Ctrl-W q close");
+}
+
+void closePane() {
+    struct Pane *p = active_pane;
+    if (!p->parent) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't close the last pane.");
+        return;
+    }
+
+    // the sibling takes over the parent's slot in the tree
+    struct Pane *parent = p->parent;
+    struct Pane *sibling = parent->first == p ? parent->second : parent->first;
+    struct Pane *grand = parent->parent;
+    *parent = *sibling;
+    parent->parent = grand;
+    if (parent->split) {
+        parent->first->parent = parent;
+        parent->second->parent = parent;
+    }
+    free(p->hl_first);
+    free(p);
+    free(sibling);
+
+    struct Pane *leaf = parent;
+    while (leaf->split) leaf = leaf->first;
+    layoutPanes(root_pane, 0, 0, screen_rows, screen_cols);
+    loadPane(leaf);
+    full_redraw = 1;
+    snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+}
+
+static struct Pane *nextLeaf(struct Pane *p) {
+    // climb until we can step right, then descend to the leftmost leaf
+    while (p->parent && p->parent->second == p) p = p->parent;
+    p = p->parent ? p->parent->second : root_pane;
+    while (p->split) p = p->first;
+    return p;
+}
+
+void focusNextPane() {
+    struct Pane *next = nextLeaf(active_pane);
+    if (next == active_pane) return;
+    activatePane(next);
+    snprintf(statusmsg, sizeof(statusmsg), "[Pane] %s", B->filename);
+}
+
+// edits show up in every pane looking at the buffer
+void damageBuffer(struct Buffer *buf) {
+    struct Pane *p = root_pane;
+    while (p->split) p = p->first;
+    struct Pane *start = p;
+    do {
+        if (p->buf == buf) p->damaged = 1;
+        p = nextLeaf(p);
+    } while (p != start);
+}
+
+/*** View Functions ***/
+
+// rebuild the fold tree in O(folds) after folds were added or removed; line edits only
+// shift the fold ends, and open the folds they touch with a point update
+static void foldSync(struct Buffer *b) {
+    if (!b->fold_dirty) return;
+    int n = 0;
+    for (int f = 0; f < b->num_folds; f++) {
+        if (b->folds[f].end > b->folds[f].start) b->folds[n++] = b->folds[f];
+    }
+    b->num_folds = n;
+    b->fold_tree = realloc(b->fold_tree, (n + 1) * sizeof(int));
+    if (!b->fold_tree) die("realloc");
+    b->fold_hidden = 0;
+    for (int i = 1; i <= n; i++) {
+        b->fold_tree[i] = b->folds[i - 1].end - b->folds[i - 1].start;
+        b->fold_hidden += b->fold_tree[i];
+    }
+    for (int i = 1; i <= n; i++) {
+        int j = i + (i & -i);
+        if (j <= n) b->fold_tree[j] += b->fold_tree[i];
+    }
+    b->fold_dirty = 0;
+}
+
+// lines hidden by the first n folds
+static int foldPrefix(struct Buffer *b, int n) {
+    int hidden = 0;
+    for (; n > 0; n -= n & -n) hidden += b->fold_tree[n];
+    return hidden;
+}
+
+// open fold f where it is, so the tree keeps its shape
+static void foldEmpty(struct Buffer *b, int f) {
+    int hidden = b->folds[f].end - b->folds[f].start;
+    b->folds[f].end = b->folds[f].start;
+    if (b->fold_dirty || hidden == 0) return;
+    b->fold_hidden -= hidden;
+    for (int i = f + 1; i <= b->num_folds; i += i & -i) b->fold_tree[i] -= hidden;
+}
+
+// folds starting above line
+static int foldsBefore(struct Buffer *b, int line) {
+    int lo = 0, hi = b->num_folds;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->folds[mid].start < line) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int numRows(struct Buffer *b) {
+    if (b->filter_on) return b->filter_count;
+    if (b->num_folds == 0) return b->num_lines;
+    foldSync(b);
+    return b->num_lines - b->fold_hidden;
+}
+
+// row must be below numRows
+int rowToLine(struct Buffer *b, int row) {
+    if (b->filter_on) return b->filter_lines[row];
+    if (b->num_folds == 0) return row;
+
+    // the last fold whose start line shows above row, the line is past its hidden lines
+    foldSync(b);
+    int lo = 0, hi = b->num_folds;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->folds[mid].start - foldPrefix(b, mid) < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return row + foldPrefix(b, lo);
+}
+
+// a hidden line maps to the row of the next shown line
+int lineToRow(struct Buffer *b, int line) {
+    if (!b->filter_on) {
+        if (b->num_folds == 0) return line;
+        foldSync(b);
+        if (line > b->num_lines) line = b->num_lines;
+        int k = foldsBefore(b, line);
+        if (k > 0 && line <= b->folds[k - 1].end) return b->folds[k - 1].start + 1 - foldPrefix(b, k - 1);
+        return line - foldPrefix(b, k);
+    }
+    int lo = 0, hi = b->filter_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->filter_lines[mid] < line) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+void scrollToCursor() {
+    int row = lineToRow(B, B->cy);
+    if (row < B->rowoff) B->rowoff = row;
+    if (row >= B->rowoff + editor_rows) B->rowoff = row - editor_rows + 1;
+}
+
+void centerCursor() {
+    int row = lineToRow(B, B->cy);
+    B->rowoff = row > editor_rows / 2 ? row - editor_rows / 2 : 0;
+}
+
+static void filterPush(struct Buffer *b, int line) {
+    if (b->filter_count == b->filter_cap) {
+        b->filter_cap = b->filter_cap ? b->filter_cap * 2 : 1024;
+        b->filter_lines = realloc(b->filter_lines, b->filter_cap * sizeof(int));
+        if (!b->filter_lines) die("realloc");
+    }
+    b->filter_lines[b->filter_count++] = line;
+}
+
+// checks the lines not seen yet, which is how appended lines join the view
+void extendFilter(struct Buffer *b) {
+    if (!b->filter_on) return;
+    int qlen = strlen(b->filter_query);
+    // an unfinished last line may still grow into a match, so it is checked again later
+    int end = b->num_lines - (b->tail_open ? 1 : 0);
+    int start = b->filter_scanned;
+    if (start >= b->num_lines) return;
+    int before = b->filter_count;
+    for (int y = start; y < b->num_lines; y++) {
+        if (b->filter_count > 0 && b->filter_lines[b->filter_count - 1] >= y) continue;
+        char *line = b->lines[y];
+        if (line && findPattern(line, strlen(line), b->filter_query, qlen)) filterPush(b, y);
+    }
+    b->filter_scanned = end > start ? end : start;
+    if (b->filter_count != before) b->match_gen++;
+}
+
+void buildFilter(struct Buffer *b) {
+    b->filter_count = 0;
+    b->filter_scanned = 0;
+    extendFilter(b);
+    b->match_gen++;
+}
+
+// less-style &: show only the lines matching the current search, Esc shows all again
+void toggleFilterView() {
+    int line = B->cy;
+    if (B->filter_on) {
+        B->filter_on = 0;
+        B->match_gen++;
+        centerCursor();
+        snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+        return;
+    }
+    if (B->search_query_len == 0) return;
+
+    snprintf(B->filter_query, sizeof(B->filter_query), "%s", B->search_query);
+    B->filter_on = 1;
+    buildFilter(B);
+    if (B->filter_count == 0) {
+        B->filter_on = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Filter] No lines match %.40s", B->filter_query);
+        return;
+    }
+    // stay on the cursor line if it is shown, else the next shown one
+    int row = lineToRow(B, line);
+    if (row >= B->filter_count) row = B->filter_count - 1;
+    B->cy = rowToLine(B, row);
+    int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+    if (B->cx > len) B->cx = len;
+    centerCursor();
+    snprintf(statusmsg, sizeof(statusmsg), "[Filter] %d of %d lines match %.40s", B->filter_count, B->num_lines,
+             B->filter_query);
+}
+
+// lines [at, at + n) were inserted; they are shown even if they don't match
+void viewLinesInserted(struct Buffer *b, int at, int n) {
+    if (n <= 0) return;
+    shiftMarks(b, at, n);
+    // folds after the edit move down, a fold edited inside is opened
+    int f = foldsBefore(b, at);
+    if (f > 0 && at <= b->folds[f - 1].end) foldEmpty(b, f - 1);
+    for (; f < b->num_folds; f++) b->folds[f].start += n, b->folds[f].end += n;
+    linesReplaced(b, at, 0, n);
+
+    if (!b->filter_on) return;
+    int idx = lineToRow(b, at);
+    for (int i = 0; i < n; i++) filterPush(b, 0); // make room
+    memmove(&b->filter_lines[idx + n], &b->filter_lines[idx], (b->filter_count - n - idx) * sizeof(int));
+    for (int i = 0; i < n; i++) b->filter_lines[idx + i] = at + i;
+    for (int i = idx + n; i < b->filter_count; i++) b->filter_lines[i] += n;
+    if (b->filter_scanned >= at) b->filter_scanned += n;
+    b->match_gen++;
+}
+
+// lines [at, at + n) were removed
+void viewLinesDeleted(struct Buffer *b, int at, int n) {
+    if (n <= 0) return;
+    shiftMarks(b, at, -n);
+    // folds the range overlaps are opened, those starting inside it collapse onto at
+    int f = foldsBefore(b, at);
+    if (f > 0 && at <= b->folds[f - 1].end) foldEmpty(b, f - 1);
+    for (; f < b->num_folds && b->folds[f].start < at + n; f++) {
+        foldEmpty(b, f);
+        b->folds[f].start = b->folds[f].end = at;
+    }
+    for (; f < b->num_folds; f++) b->folds[f].start -= n, b->folds[f].end -= n;
+    linesReplaced(b, at, n, 0);
+
+    if (!b->filter_on) return;
+    int lo = lineToRow(b, at), hi = lineToRow(b, at + n);
+    memmove(&b->filter_lines[lo], &b->filter_lines[hi], (b->filter_count - hi) * sizeof(int));
+    b->filter_count -= hi - lo;
+    for (int i = lo; i < b->filter_count; i++) b->filter_lines[i] -= n;
+    if (b->filter_scanned >= at + n) b->filter_scanned -= n;
+    else if (b->filter_scanned > at) b->filter_scanned = at;
+    b->match_gen++;
+}
+
+int lineHidden(struct Buffer *b, int line) {
+    int row = lineToRow(b, line);
+    return row >= numRows(b) || rowToLine(b, row) != line;
+}
+
+// number of lines folded under line, 0 if it does not start a fold
+int foldAt(struct Buffer *b, int line) {
+    int f = foldsBefore(b, line + 1) - 1; // opened folds sort ahead of a live one at the same start
+    return f >= 0 && b->folds[f].start == line ? b->folds[f].end - line : 0;
+}
+
+// folds it overlaps are merged into it, so nested folds close as one
+void addFold(struct Buffer *b, int start, int end) {
+    if (end >= b->num_lines) end = b->num_lines - 1;
+    if (end <= start) return;
+    int w = 0;
+    for (int f = 0; f < b->num_folds; f++) {
+        struct Fold fd = b->folds[f];
+        if (fd.start <= end && fd.end >= start) {
+            if (fd.start < start) start = fd.start;
+            if (fd.end > end) end = fd.end;
+            continue;
+        }
+        b->folds[w++] = fd;
+    }
+    b->num_folds = w;
+    if (b->num_folds == b->folds_cap) {
+        b->folds_cap = b->folds_cap ? b->folds_cap * 2 : 16;
+        b->folds = realloc(b->folds, b->folds_cap * sizeof(struct Fold));
+        if (!b->folds) die("realloc");
+    }
+    int i = b->num_folds;
+    while (i > 0 && b->folds[i - 1].start > start) {
+        b->folds[i] = b->folds[i - 1];
+        i--;
+    }
+    b->folds[i] = (struct Fold){start, end};
+    b->num_folds++;
+    b->fold_dirty = 1;
+    b->match_gen++;
+}
+
+void clearFolds(struct Buffer *b) {
+    if (b->num_folds == 0) return;
+    b->num_folds = 0;
+    b->fold_dirty = 1;
+    b->match_gen++;
+}
+
+static int indentOf(const char *line) {
+    int w = 0;
+    for (; *line == ' ' || *line == '\t'; line++) w += *line == '\t' ? 4 - w % 4 : 1;
+    return *line ? w : -1; // -1 for a blank line
+}
+
+// opens the fold under the cursor, or folds the block the cursor line starts:
+// up to the matching } when it ends in {, else the lines indented deeper
+void toggleFold() {
+    int y = B->cy;
+    int n = foldAt(B, y);
+    if (n) {
+        foldEmpty(B, foldsBefore(B, y + 1) - 1);
+        B->match_gen++;
+        snprintf(statusmsg, sizeof(statusmsg), "[Fold] Opened %d lines", n);
+        return;
+    }
+
+    char *line = B->lines[y] ? B->lines[y] : "";
+    int len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    int end = y;
+    if (len > 0 && line[len - 1] == '{') {
+        int depth = 0;
+        for (int i = y; i < B->num_lines && end == y; i++) {
+            for (char *c = B->lines[i]; c && *c; c++) {
+                if (*c == '{') depth++;
+                else if (*c == '}' && --depth == 0) {
+                    end = i;
+                    break;
+                }
+            }
+        }
+    } else {
+        int base = indentOf(line);
+        for (int i = y + 1; i < B->num_lines && base >= 0; i++) {
+            int ind = indentOf(B->lines[i] ? B->lines[i] : "");
+            if (ind == -1) continue; // blank lines don't end a block
+            if (ind <= base) break;
+            end = i;
+        }
+    }
+    if (end == y) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Fold] Nothing to fold here");
+        return;
+    }
+    addFold(B, y, end);
+    snprintf(statusmsg, sizeof(statusmsg), "[Fold] Folded %d lines", end - y);
+}
+
+// opens the folds hiding line, for when the cursor has to land on it
+void revealLine(int line) {
+    int f = foldsBefore(B, line) - 1; // folds don't nest, only this one can hide line
+    if (f < 0 || line > B->folds[f].end) return;
+    foldEmpty(B, f);
+    B->match_gen++;
+}
+
+/*** File Watch Functions ***/
+
+void startWatch(const char *filename) {
+    stat(filename, &B->watch_st);
+#ifdef __linux__
+    if (watch_fd == -1) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd == -1) return; // fall back to polling with stat()
+    }
+    B->watch_wd = inotify_add_watch(watch_fd, filename,
+                                 IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                 IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+}
+
+// returns 1 if the current buffer's file may have changed since the last call,
+// other buffers are only flagged and get handled when they become current
+int pollWatch() {
+#ifdef __linux__
+    if (watch_fd != -1) {
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(watch_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                for (int i = 0; i < num_buffers; i++) {
+                    struct Buffer *b = buffers[i];
+                    if (b->watch_wd != ev->wd) continue;
+                    b->disk_changed = 1;
+                    // the file was rotated or replaced, watch whatever now has its name
+                    if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+                        inotify_rm_watch(watch_fd, b->watch_wd);
+                        b->watch_wd = inotify_add_watch(watch_fd, b->filename,
+                                                        IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                                                        IN_MOVE_SELF | IN_DELETE_SELF);
+                    }
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        int changed = B->disk_changed;
+        B->disk_changed = 0;
+        return changed;
+    }
+#endif
+    struct stat st;
+    if (stat(B->filename, &st) == -1) return 0;
+    int changed = st.st_size != B->watch_st.st_size || st.st_mtime != B->watch_st.st_mtime ||
+                  st.st_ino != B->watch_st.st_ino;
+    B->watch_st = st;
+    return changed;
+}
+
+// read only the bytes appended since the last load and split them into lines
+void ingestAppend() {
+    int fd = open(B->filename, O_RDONLY);
+    if (fd == -1) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == B->file_size) {
+        close(fd);
+        return;
+    }
+    if (st.st_size < B->file_size) {
+        // truncated or rotated, nothing appended to what we have
+        close(fd);
+        reloadFile();
+        return;
+    }
+
+    int at_bottom = B->rowoff + editor_rows >= numRows(B);
+    int old_lines = B->num_lines;
+    static char buf[READ_CHUNK];
+    ssize_t n;
+
+    if (lseek(fd, B->file_size, SEEK_SET) == -1) {
+        close(fd);
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        B->file_size += n;
+        char *p = buf;
+        char *end = buf + n;
+        while (p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            int seg = (nl ? nl : end) - p;
+            if (B->tail_open && B->num_lines > 0) {
+                // continue the line left unfinished by the previous read
+                int len = strlen(B->lines[B->num_lines - 1]);
+                indexSpan(B, B->num_lines - 1, B->lines[B->num_lines - 1], len, len, -1);
+                struct LineStats before = spanStats(B->lines[B->num_lines - 1], len, len);
+                B->lines[B->num_lines - 1] = lineRealloc(B->lines[B->num_lines - 1], len + seg + 1);
+                memcpy(&B->lines[B->num_lines - 1][len], p, seg);
+                B->lines[B->num_lines - 1][len + seg] = '\0';
+                indexSpan(B, B->num_lines - 1, B->lines[B->num_lines - 1], len, len + seg, 1);
+                lineEdited(B, B->num_lines - 1, before, spanStats(B->lines[B->num_lines - 1], len, len + seg));
+                bracketsChanged(B, B->num_lines - 1);
+            } else {
+                ensureLineCapacity(B->num_lines + 1);
+                B->lines[B->num_lines] = lineAlloc(seg + 1);
+                memcpy(B->lines[B->num_lines], p, seg);
+                B->lines[B->num_lines][seg] = '\0';
+                indexLine(B, B->num_lines, B->lines[B->num_lines], 1);
+                B->num_lines++;
+                lineAppended(B);
+            }
+            B->tail_open = nl == NULL;
+            p += seg + (nl ? 1 : 0);
+        }
+    }
+    close(fd);
+    extendFilter(B);
+
+    // keep tailing only if the user was already looking at the end
+    if (at_bottom && numRows(B) > 0) {
+        B->cy = rowToLine(B, numRows(B) - 1);
+        B->cx = 0;
+        scrollToCursor();
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Follow Mode] +%d lines", B->num_lines - old_lines);
+}
+
+// map a whole file read-only, *map is NULL for an empty file
+int mapFile(const char *filename, char **map, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    *map = NULL;
+    *size = st.st_size;
+    if (st.st_size > 0) {
+        *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*map == MAP_FAILED) {
+            *map = NULL;
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// shift a line number the way a hunk moves the text around it
+static int remapLine(int y, const struct DiffHunk *h) {
+    if (y < h->a_start) return y;
+    if (y >= h->a_start + h->a_len) return y + h->b_len - h->a_len;
+    // inside the replaced range, stay as close as the new text allows
+    int off = y - h->a_start;
+    if (off >= h->b_len) off = h->b_len - 1;
+    return off < 0 ? h->b_start : h->b_start + off;
+}
+
+// re-read the file and patch only the lines that differ from the buffer
+void reloadFile() {
+    char *map;
+    size_t size;
+    if (mapFile(B->filename, &map, &size) == -1) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't reload! mmap error.");
+        return;
+    }
+
+    // index and hash the new text without copying it
+    struct LineIndex disk;
+    indexText(map, size, &disk);
+    const char **b_ptr = disk.ptr;
+    int *b_len = disk.len;
+    int m = disk.count;
+
+    uint64_t *a = hashBufferLines();
+    struct DiffHunk *hunks = NULL;
+    clearCursors();
+    int num_hunks = diffHashes(a, B->num_lines, disk.hash, m, &hunks);
+
+    // apply back to front so earlier hunk positions stay valid
+    ensureLineCapacity(B->num_lines + m + 1);
+    int changed = 0;
+    int peak = B->num_lines;
+    for (int h = num_hunks - 1; h >= 0; h--) {
+        struct DiffHunk *hk = &hunks[h];
+        for (int i = hk->a_start; i < hk->a_start + hk->a_len; i++) {
+            indexLine(B, i, B->lines[i], -1);
+            lineFree(B->lines[i]);
+        }
+        if (hk->b_len != hk->a_len) {
+            memmove(&B->lines[hk->a_start + hk->b_len], &B->lines[hk->a_start + hk->a_len],
+                    (B->num_lines - hk->a_start - hk->a_len) * sizeof(char *));
+        }
+        for (int i = 0; i < hk->b_len; i++) {
+            int len = b_len[hk->b_start + i];
+            char *line = lineAlloc(len + 1);
+            memcpy(line, b_ptr[hk->b_start + i], len);
+            line[len] = '\0';
+            B->lines[hk->a_start + i] = line;
+        }
+        B->num_lines += hk->b_len - hk->a_len;
+        linesReplaced(B, hk->a_start, hk->a_len, hk->b_len);
+        // indexed after the report so a build copying past the hunk replays its new words
+        for (int i = hk->a_start; i < hk->a_start + hk->b_len; i++) indexLine(B, i, B->lines[i], 1);
+        // marks below the hunk follow it, marks on dropped lines go to its end
+        shiftMarks(B, hk->a_start + (hk->a_len < hk->b_len ? hk->a_len : hk->b_len), hk->b_len - hk->a_len);
+        if (B->num_lines > peak) peak = B->num_lines;
+        changed += hk->a_len > hk->b_len ? hk->a_len : hk->b_len;
+    }
+    // clear the stale pointers left behind when the buffer shrank
+    for (int i = B->num_lines; i < peak; i++) B->lines[i] = NULL;
+
+    // move cursor, selection and scroll along with the text they point at
+    for (int h = num_hunks - 1; h >= 0; h--) {
+        B->cy = remapLine(B->cy, &hunks[h]);
+        sy = remapLine(sy, &hunks[h]);
+        if (!B->filter_on) B->rowoff = remapLine(B->rowoff, &hunks[h]);
+    }
+    if (B->cy >= B->num_lines) B->cy = B->num_lines > 0 ? B->num_lines - 1 : 0;
+    if (sy >= B->num_lines) sy = B->cy;
+    if (B->filter_on) buildFilter(B);
+    clearFolds(B);
+    scrollToCursor();
+    int len = B->lines[B->cy] ? strlen(B->lines[B->cy]) : 0;
+    if (B->cx > len) B->cx = len;
+
+    if (B->search_mode == 2) {
+        collectMatches();
+        if (B->current_match >= B->num_matches) B->current_match = B->num_matches - 1;
+    }
+
+    B->file_size = size;
+    B->tail_open = size > 0 && map[size - 1] != '\n';
+    B->dirty = 0;
+    if (map) munmap(map, size);
+    free(a);
+    freeLineIndex(&disk);
+    free(hunks);
+    snprintf(statusmsg, sizeof(statusmsg), "[Reloaded] %d hunks, %d lines changed", num_hunks, changed);
+}
+
+void toggleFollowMode() {
+    if (B->follow_mode) {
+        B->follow_mode = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+        return;
+    }
+
+    B->follow_mode = 1;
+    ingestAppend();
+    if (numRows(B) > 0) {
+        B->cy = rowToLine(B, numRows(B) - 1);
+        B->cx = 0;
+        B->rowoff = numRows(B) > editor_rows ? numRows(B) - editor_rows : 0;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Follow Mode] Watching %s", B->filename);
+}
+
+/*** Diff Functions ***/
+
+uint64_t hashLine(const char *s, int len) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t *hashBufferLines() {
+    uint64_t *h = malloc((B->num_lines + 1) * sizeof(*h));
+    for (int i = 0; i < B->num_lines; i++) {
+        h[i] = B->lines[i] ? hashLine(B->lines[i], strlen(B->lines[i])) : hashLine("", 0);
+    }
+    return h;
+}
+
+void indexText(const char *text, size_t size, struct LineIndex *idx) {
+    int cap = 0;
+    memset(idx, 0, sizeof(*idx));
+    const char *p = text;
+    const char *end = text + size;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        int seg = (nl ? nl : end) - p;
+        if (idx->count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            idx->ptr = realloc(idx->ptr, cap * sizeof(*idx->ptr));
+            idx->len = realloc(idx->len, cap * sizeof(*idx->len));
+            idx->hash = realloc(idx->hash, cap * sizeof(*idx->hash));
+        }
+        idx->ptr[idx->count] = p;
+        idx->len[idx->count] = strnlen(p, seg); // lines are C strings, match loadFile
+        idx->hash[idx->count] = hashLine(p, idx->len[idx->count]);
+        idx->count++;
+        p += seg + (nl ? 1 : 0);
+    }
+}
+
+void freeLineIndex(struct LineIndex *idx) {
+    free(idx->ptr);
+    free(idx->len);
+    free(idx->hash);
+    memset(idx, 0, sizeof(*idx));
+}
+
+struct DiffState {
+    const uint64_t *a, *b;
+    int *vf, *vb; // furthest reaching x (forward) and y (backward) per diagonal
+    struct DiffHunk *hunks;
+    int num_hunks, cap;
+};
+
+static void diffEmit(struct DiffState *ds, int a_start, int a_len, int b_start, int b_len) {
+    if (a_len == 0 && b_len == 0) return;
+    if (ds->num_hunks > 0) {
+        struct DiffHunk *last = &ds->hunks[ds->num_hunks - 1];
+        if (last->a_start + last->a_len == a_start && last->b_start + last->b_len == b_start) {
+            last->a_len += a_len;
+            last->b_len += b_len;
+            return;
+        }
+    }
+    if (ds->num_hunks == ds->cap) {
+        ds->cap = ds->cap ? ds->cap * 2 : 16;
+        ds->hunks = realloc(ds->hunks, ds->cap * sizeof(struct DiffHunk));
+    }
+    ds->hunks[ds->num_hunks++] = (struct DiffHunk){a_start, a_len, b_start, b_len};
+}
+
+// Myers' middle snake: the edit path splits at (*sx,*sy)-(*ex,*ey) using O(n + m) space
+static int diffMidpoint(struct DiffState *ds, int left, int top, int right, int bottom,
+                        int *sx, int *sy, int *ex, int *ey) {
+    const uint64_t *a = ds->a, *b = ds->b;
+    int width = right - left;
+    int height = bottom - top;
+    int delta = width - height;
+    int max = (width + height + 1) / 2;
+    if (max > DIFF_MAX_COST) max = DIFF_MAX_COST;
+    int *vf = ds->vf + max + 1;
+    int *vb = ds->vb + max + 1;
+
+    vf[1] = left;
+    vb[1] = bottom;
+    for (int d = 0; d <= max; d++) {
+        for (int k = d; k >= -d; k -= 2) {
+            int c = k - delta;
+            int x, px;
+            if (k == -d || (k != d && vf[k - 1] < vf[k + 1])) {
+                px = x = vf[k + 1];
+            } else {
+                px = vf[k - 1];
+                x = px + 1;
+            }
+            int y = top + (x - left) - k;
+            int py = (d == 0 || x != px) ? y : y - 1;
+            while (x < right && y < bottom && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            vf[k] = x;
+            if ((delta & 1) && c >= -(d - 1) && c <= d - 1 && y >= vb[c]) {
+                *sx = px; *sy = py; *ex = x; *ey = y;
+                return 1;
+            }
+        }
+        for (int c = d; c >= -d; c -= 2) {
+            int k = c + delta;
+            int y, py;
+            if (c == -d || (c != d && vb[c - 1] > vb[c + 1])) {
+                py = y = vb[c + 1];
+            } else {
+                py = vb[c - 1];
+                y = py - 1;
+            }
+            int x = left + (y - top) + k;
+            int px = (d == 0 || y != py) ? x : x + 1;
+            while (x > left && y > top && a[x - 1] == b[y - 1]) {
+                x--;
+                y--;
+            }
+            vb[c] = y;
+            if (!(delta & 1) && k >= -d && k <= d && x <= vf[k]) {
+                *sx = x; *sy = y; *ex = px; *ey = py;
+                return 1;
+            }
+        }
+    }
+    return 0; // too expensive, caller replaces the whole range
+}
+
+static void diffRange(struct DiffState *ds, int left, int top, int right, int bottom) {
+    // strip common head and tail, usually all that is left of a small change
+    while (left < right && top < bottom && ds->a[left] == ds->b[top]) {
+        left++;
+        top++;
+    }
+    while (left < right && top < bottom && ds->a[right - 1] == ds->b[bottom - 1]) {
+        right--;
+        bottom--;
+    }
+    if (left == right || top == bottom) {
+        diffEmit(ds, left, right - left, top, bottom - top);
+        return;
+    }
+
+    int sx, sy, ex, ey;
+    if (!diffMidpoint(ds, left, top, right, bottom, &sx, &sy, &ex, &ey)) {
+        diffEmit(ds, left, right - left, top, bottom - top);
+        return;
+    }
+    diffRange(ds, left, top, sx, sy);
+    diffRange(ds, sx, sy, ex, ey);
+    diffRange(ds, ex, ey, right, bottom);
+}
+
+// line-level diff of two hash arrays, returns the number of hunks stored in *hunks
+int diffHashes(const uint64_t *a, int n, const uint64_t *b, int m, struct DiffHunk **hunks) {
+    struct DiffState ds = {a, b, NULL, NULL, NULL, 0, 0};
+    int max = (n + m + 1) / 2;
+    if (max > DIFF_MAX_COST) max = DIFF_MAX_COST;
+    ds.vf = malloc((2 * max + 3) * sizeof(int));
+    ds.vb = malloc((2 * max + 3) * sizeof(int));
+
+    diffRange(&ds, 0, 0, n, m);
+
+    free(ds.vf);
+    free(ds.vb);
+    *hunks = ds.hunks;
+    return ds.num_hunks;
+}
+
+/*** Diff View Functions ***/
+
+// runs on its own thread; the buffer is read-only while the diff view is up
+static void *diffWorker(void *arg) {
+    (void)arg;
+    if (mapFile(B->filename, &diff_map, &diff_map_size) == -1) {
+        diff_map = NULL;
+        diff_map_size = 0;
+    }
+    indexText(diff_map, diff_map_size, &diff_disk);
+
+    uint64_t *buf_hashes = hashBufferLines();
+    diff_num_hunks = diffHashes(diff_disk.hash, diff_disk.count, buf_hashes, B->num_lines, &diff_hunks);
+    free(buf_hashes);
+
+    diff_row_start = malloc((diff_num_hunks + 1) * sizeof(int));
+    int deleted = 0;
+    for (int h = 0; h < diff_num_hunks; h++) {
+        diff_row_start[h] = diff_hunks[h].b_start + deleted;
+        deleted += diff_hunks[h].a_len;
+    }
+    diff_rows = B->num_lines + deleted;
+
+    atomic_store(&diff_ready, 1);
+    return NULL;
+}
+
+void enterDiffView() {
+    diff_view = 1;
+    diff_rowoff = 0;
+    atomic_store(&diff_ready, 0);
+    if (pthread_create(&diff_thread, NULL, diffWorker, NULL) != 0) {
+        diff_view = 0;
+        snprintf(statusmsg, sizeof(statusmsg), "Can't diff! pthread_create error.");
+        return;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Diff] Comparing with %s...", B->filename);
+}
+
+void exitDiffView() {
+    if (!diff_view) return;
+
+    // the worker may still be reading lines, wait before editing resumes
+    pthread_join(diff_thread, NULL);
+    if (diff_map) munmap(diff_map, diff_map_size);
+    diff_map = NULL;
+    freeLineIndex(&diff_disk);
+    free(diff_hunks);
+    free(diff_row_start);
+    diff_hunks = NULL;
+    diff_row_start = NULL;
+    diff_num_hunks = 0;
+    diff_view = 0;
+    snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+}
+
+// called from the main loop, switches to the results once the worker is done
+void pollDiffView() {
+    if (diff_view != 1 || !atomic_load(&diff_ready)) return;
+
+    pthread_join(diff_thread, NULL);
+    diff_view = 2;
+    int added = 0, deleted = 0;
+    for (int h = 0; h < diff_num_hunks; h++) {
+        added += diff_hunks[h].b_len;
+        deleted += diff_hunks[h].a_len;
+    }
+    if (diff_num_hunks > 0) diff_rowoff = diff_row_start[0];
+    snprintf(statusmsg, sizeof(statusmsg), "[Diff] %d hunks +%d -%d, n/p next/prev hunk",
+             diff_num_hunks, added, deleted);
+    editorRefreshScreen();
+}
+
+// resolve a display row, returns '-' for a disk line, '+' for an added buffer line, ' ' otherwise
+int diffRowAt(int row, int *line) {
+    int lo = 0, hi = diff_num_hunks - 1, h = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (diff_row_start[mid] <= row) {
+            h = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (h < 0) {
+        *line = row;
+        return ' ';
+    }
+
+    struct DiffHunk *hk = &diff_hunks[h];
+    int off = row - diff_row_start[h];
+    if (off < hk->a_len) {
+        *line = hk->a_start + off;
+        return '-';
+    }
+    off -= hk->a_len;
+    *line = hk->b_start + off;
+    return off < hk->b_len ? '+' : ' ';
+}
+
+void diffJumpHunk(int dir) {
+    if (diff_view != 2 || diff_num_hunks == 0) return;
+
+    if (dir > 0) {
+        for (int h = 0; h < diff_num_hunks; h++) {
+            if (diff_row_start[h] > diff_rowoff) {
+                diff_rowoff = diff_row_start[h];
+                return;
+            }
+        }
     } else {
-        // handle multi-line selection
-        // first line: keep text before start_x
-        int first_len = strlen(lines[start_y]);
-        lines[start_y] = realloc(lines[start_y], start_x + 1);
-        lines[start_y][start_x] = '\0';
+        for (int h = diff_num_hunks - 1; h >= 0; h--) {
+            if (diff_row_start[h] < diff_rowoff) {
+                diff_rowoff = diff_row_start[h];
+                return;
+            }
+        }
+    }
+}
 
-        // last line: keep text after end_x
-        int last_len = strlen(lines[end_y]);
-        char *last_part = malloc(last_len - end_x + 1);
-        strcpy(last_part, &lines[end_y][end_x]);
-        free(lines[end_y]);
-        lines[end_y] = last_part;
+/*** Hex View Functions ***/
 
-        // concatenate first and last lines
-        int new_len = strlen(lines[start_y]) + strlen(lines[end_y]) + 1;
-        lines[start_y] = realloc(lines[start_y], new_len);
-        strcat(lines[start_y], lines[end_y]);
-        free(lines[end_y]);
+// first patch at or after off
+static int hexFind(off_t off) {
+    int lo = 0, hi = hex_num_patches;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (hex_patches[mid].off < off) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// bytes per row, halved until a row fits the pane
+static int hexPerRow() {
+    int per = 16;
+    while (per > 4 && 10 + per * 4 + 3 > active_pane->cols) per /= 2;
+    return per;
+}
+
+// hex digits in the offset column, 8 unless the file is over 4GB
+static int hexDigits() {
+    int w = 8;
+    while (w < 16 && (hex_size >> (4 * w))) w++;
+    return w;
+}
+
+static void hexScroll() {
+    off_t row = hex_cursor / hexPerRow();
+    if (row < hex_rowoff) hex_rowoff = row;
+    if (row >= hex_rowoff + active_pane->rows) hex_rowoff = row - active_pane->rows + 1;
+}
+
+void enterHexView() {
+    if (B->scratch) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't show hex! %.40s is not a file.", B->filename);
+        return;
+    }
+    if (mapFile(B->filename, &hex_map, &hex_size) == -1) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't show hex! mmap error.");
+        return;
+    }
+    hex_view = 1;
+    hex_cursor = 0;
+    hex_rowoff = 0;
+    hex_low = 0;
+    hex_text = 0;
+    hex_drop = 0;
+    visual_mode = 0;
+    clearCursors();
+    snprintf(statusmsg, sizeof(statusmsg), "[Hex] %lld bytes, Tab hex/text column, Ctrl-S write",
+             (long long)hex_size);
+}
+
+void exitHexView() {
+    if (!hex_view) return;
+
+    if (hex_map) munmap(hex_map, hex_size);
+    hex_map = NULL;
+    hex_size = 0;
+    free(hex_patches);
+    hex_patches = NULL;
+    hex_num_patches = 0;
+    hex_patches_cap = 0;
+    hex_view = 0;
+    snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+}
+
+// the byte at off as it will be saved
+int hexByte(off_t off, int *patched) {
+    int i = hexFind(off);
+    *patched = i < hex_num_patches && hex_patches[i].off == off;
+    return *patched ? hex_patches[i].byte : (unsigned char)hex_map[off];
+}
 
-        // shift lines up
-        for (int i = end_y; i < num_lines - 1; i++) {
-            lines[i] = lines[i + 1];
+// setting a byte back to what the file holds drops its patch
+void hexPatch(off_t off, unsigned char byte) {
+    int i = hexFind(off);
+    int found = i < hex_num_patches && hex_patches[i].off == off;
+    if (byte == (unsigned char)hex_map[off]) {
+        if (found) {
+            memmove(&hex_patches[i], &hex_patches[i + 1], (hex_num_patches - i - 1) * sizeof(struct HexPatch));
+            hex_num_patches--;
+        }
+        return;
+    }
+    if (!found) {
+        if (hex_num_patches == hex_patches_cap) {
+            hex_patches_cap = hex_patches_cap ? hex_patches_cap * 2 : 64;
+            hex_patches = realloc(hex_patches, hex_patches_cap * sizeof(struct HexPatch));
+            if (!hex_patches) die("realloc");
         }
-        lines[num_lines - 1] = NULL;
+        memmove(&hex_patches[i + 1], &hex_patches[i], (hex_num_patches - i) * sizeof(struct HexPatch));
+        hex_num_patches++;
+        hex_patches[i].off = off;
+    }
+    hex_patches[i].byte = byte;
+    hex_drop = 0;
+}
 
-        // remove intermediate lines
-        for (int i = start_y + 1; i < end_y; i++) {
-            free(lines[i]);
-            lines[i] = NULL;
+// each run of adjacent patches goes out with one pwrite, the rest of the file is not touched
+void saveHexPatches() {
+    if (hex_num_patches == 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Hex] No changes to write");
+        return;
+    }
+    int fd = open(B->filename, O_WRONLY);
+    if (fd == -1) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't save! open error.");
+        return;
+    }
+
+    unsigned char run[4096];
+    int written = 0;
+    for (int i = 0; i < hex_num_patches;) {
+        off_t start = hex_patches[i].off;
+        int n = 0;
+        while (i < hex_num_patches && n < (int)sizeof(run) && hex_patches[i].off == start + n) {
+            run[n++] = hex_patches[i++].byte;
+        }
+        if (pwrite(fd, run, n, start) != n) {
+            // the patches stay, writing them again is harmless
+            close(fd);
+            snprintf(statusmsg, sizeof(statusmsg), "Can't save! pwrite error.");
+            return;
+        }
+        written += n;
+    }
+    close(fd);
+
+    // the mapping is private, map the file again so it shows what is on disk now
+    munmap(hex_map, hex_size);
+    if (mapFile(B->filename, &hex_map, &hex_size) == -1) die("mmap");
+    if (hex_cursor >= (off_t)hex_size) hex_cursor = hex_size > 0 ? hex_size - 1 : 0;
+    hex_num_patches = 0;
+    hex_drop = 0;
+    snprintf(statusmsg, sizeof(statusmsg), "[Hex] Wrote %d bytes to %.40s", written, B->filename);
+}
+
+void hexGoto(off_t off) {
+    if (hex_size == 0) return;
+    if (off < 0) off = 0;
+    if (off >= (off_t)hex_size) off = hex_size - 1;
+    hex_cursor = off;
+    hex_low = 0;
+    hexScroll();
+    // put the target row in the middle of the pane
+    off_t row = hex_cursor / hexPerRow();
+    hex_rowoff = row > active_pane->rows / 2 ? row - active_pane->rows / 2 : 0;
+}
+
+// commands the hex view runs itself or refuses, 0 lets runCommand take it; the text buffer is
+// hidden behind the view, so nothing may edit or write it from here
+int hexCommand(const char *cmd) {
+    const char *p = cmd;
+    if (*p == '\0') return 1;
+    if (strncmp(p, "goto", 4) == 0 || strcmp(p, "hex") == 0 || strcmp(p, "q") == 0 || (*p == 'e' && p[1] == ' ')) {
+        return 0;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Hex] :%.40s can't run in the hex view", p);
+    return 1;
+}
+
+static int hexDigit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// keys while the hex view is up, it overwrites bytes and never inserts or deletes them
+void hexKeypress(int c) {
+    int per = hexPerRow();
+    int patched;
+    if (c == '\x1b') {
+        if (hex_num_patches > 0 && !hex_drop) {
+            hex_drop = 1;
+            snprintf(statusmsg, sizeof(statusmsg), "[Hex] %d unsaved bytes, Ctrl-S writes, Esc drops them",
+                     hex_num_patches);
+        } else if (B->binary) {
+            hex_num_patches = 0;
+            hex_drop = 0;
+            snprintf(statusmsg, sizeof(statusmsg), "[Hex] Binary file, Ctrl-Q quits");
+        } else {
+            exitHexView();
         }
-        for (int i = start_y + 1; i < num_lines - (end_y - start_y); i++) {
-            lines[i] = lines[i + (end_y - start_y)];
+    } else if (c == CTRL_KEY('q')) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        exit(0);
+    } else if (c == CTRL_KEY('s')) {
+        saveHexPatches();
+    } else if (c == CTRL_KEY('e')) {
+        enterCommandMode();
+        return;
+    } else if (c == CTRL_KEY('n')) {
+        if (hex_num_patches > 0) {
+            snprintf(statusmsg, sizeof(statusmsg), "[Hex] %d unsaved bytes, Ctrl-S writes, Esc drops them",
+                     hex_num_patches);
+        } else if (num_buffers > 1) {
+            exitHexView();
+            switchBuffer(1);
         }
-        for (int i = num_lines - (end_y - start_y); i < num_lines; i++) {
-            lines[i] = NULL;
+    } else if (c == '\t') {
+        hex_text = !hex_text;
+        hex_low = 0;
+    } else if (hex_size == 0) {
+        // nothing to move over or overwrite
+    } else if (c == ARROW_LEFT && hex_cursor > 0) {
+        hex_cursor--;
+        hex_low = 0;
+    } else if (c == ARROW_RIGHT && hex_cursor < (off_t)hex_size - 1) {
+        hex_cursor++;
+        hex_low = 0;
+    } else if (c == ARROW_UP && hex_cursor >= per) {
+        hex_cursor -= per;
+        hex_low = 0;
+    } else if (c == ARROW_DOWN && hex_cursor + per < (off_t)hex_size) {
+        hex_cursor += per;
+        hex_low = 0;
+    } else if (c == 127) {
+        // put the byte before the cursor back to what the file holds
+        if (!hex_low && hex_cursor > 0) hex_cursor--;
+        hexPatch(hex_cursor, hex_map[hex_cursor]);
+        hex_low = 0;
+    } else if (hex_text && c >= 32 && c <= 126) {
+        hexPatch(hex_cursor, c);
+        if (hex_cursor < (off_t)hex_size - 1) hex_cursor++;
+    } else if (!hex_text && hexDigit(c) >= 0) {
+        int byte = hexByte(hex_cursor, &patched);
+        if (!hex_low) {
+            hexPatch(hex_cursor, (hexDigit(c) << 4) | (byte & 0x0f));
+            hex_low = 1;
+        } else {
+            hexPatch(hex_cursor, (byte & 0xf0) | hexDigit(c));
+            hex_low = 0;
+            if (hex_cursor < (off_t)hex_size - 1) hex_cursor++;
         }
-        num_lines -= (end_y - start_y);
+    }
+    hexScroll();
+    editorRefreshScreen();
+}
 
-        cx = start_x;
-        cy = start_y;
+/*** Pager Functions ***/
+
+// offset of the k-th newline in p[0, n), or n with *k lowered by the newlines passed
+static size_t nthNewline(const char *p, size_t n, long long *k) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 64 <= n; i += 64) {
+        uint64_t m = 0;
+        for (int j = 0; j < 4; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i + 16 * j));
+            m |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * j);
+        }
+        int c = __builtin_popcountll(m);
+        if (c < *k) {
+            *k -= c;
+            continue;
+        }
+        while (--*k > 0) m &= m - 1;
+        return i + __builtin_ctzll(m);
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i] == '\n' && --*k == 0) return i;
     }
+    return n;
+}
 
-    // exit visual mode
-    visual_mode = 0;
-    snprintf(statusmsg, sizeof(statusmsg), "[Cut %d chars]", clip_len);
-
-    // adjust scroll offset
-    if (cy < rowoff) {
-        rowoff = cy;
+// last c in p[0, n); memrchr is a GNU extension
+static const char *lastByte(const char *p, size_t n, char c) {
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi8(c);
+    for (; n >= 16; n -= 16) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + n - 16)), v));
+        if (m) return p + n - 16 + 31 - __builtin_clz(m);
     }
-    if (cy >= rowoff + editor_rows) {
-        rowoff = cy - editor_rows + 1;
+#endif
+    while (n > 0) {
+        if (p[--n] == c) return p + n;
     }
+    return NULL;
 }
 
-void deleteSelection() {
-    if (!visual_mode) return;
+static const char *findPatternBack(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m == 0 || n < m) return NULL;
+    size_t end = n - m + 1; // candidates start before end
+    const char *p;
+    while ((p = lastByte(hay, end, pat[0])) != NULL) {
+        if (memcmp(p, pat, m) == 0) return p;
+        end = p - hay;
+    }
+    return NULL;
+}
 
-    // determine selection boundaries
-    int start_y = sy < cy ? sy : cy;
-    int end_y = sy < cy ? cy : sy;
-    int start_x = (sy < cy || (sy == cy && sx <= cx)) ? sx : cx;
-    int end_x = (sy < cy || (sy == cy && sx <= cx)) ? cx : sx;
+// start of the line holding the byte before off
+static off_t pagerLineStart(off_t off) {
+    const char *nl = lastByte(pager_map, off, '\n');
+    return nl ? nl - pager_map + 1 : 0;
+}
 
-    // calculate deleted chars for status message
-    int deleted_chars = 0;
-    for (int y = start_y; y <= end_y; y++) {
-        if (lines[y]) {
-            int len = strlen(lines[y]);
-            int x_start = (y == start_y) ? start_x : 0;
-            int x_end = (y == end_y) ? end_x : len;
-            deleted_chars += x_end - x_start;
-            if (y < end_y) deleted_chars++; // For newline
+// start of the line n lines below the one at off, or the end of the file
+static off_t pagerSkip(off_t off, long long n) {
+    if (n <= 0 || off >= (off_t)pager_size) return off;
+    size_t left = pager_size - off;
+    size_t at = nthNewline(pager_map + off, left, &n);
+    return at < left ? off + (off_t)at + 1 : (off_t)pager_size;
+}
+
+// a chunk that was scanned through gives its pages back, so a pass over the file keeps memory flat
+static void pagerDrop(off_t chunk) {
+    off_t start = chunk * PAGER_CHUNK;
+    if (start >= (off_t)pager_size) return;
+    size_t len = pager_size - start < PAGER_CHUNK ? pager_size - start : PAGER_CHUNK;
+    madvise(pager_map + start, len, MADV_DONTNEED);
+}
+
+// count lines up to off, leaving a mark at the start of every PAGER_STEP-th line
+static void pagerIndex(off_t off) {
+    if (off > (off_t)pager_size) off = pager_size;
+    while (pager_scanned < off) {
+        off_t chunk = pager_scanned / PAGER_CHUNK;
+        off_t end = (chunk + 1) * PAGER_CHUNK;
+        if (end > off) end = off;
+        long long want = (long long)pager_num_marks * PAGER_STEP - pager_scanned_lines;
+        long long k = want;
+        size_t n = end - pager_scanned;
+        size_t at = nthNewline(pager_map + pager_scanned, n, &k);
+        if (at < n) {
+            pager_scanned += at + 1;
+            pager_scanned_lines += want;
+            if (pager_num_marks == pager_marks_cap) {
+                pager_marks_cap *= 2;
+                pager_marks = realloc(pager_marks, pager_marks_cap * sizeof(off_t));
+                if (!pager_marks) die("realloc");
+            }
+            pager_marks[pager_num_marks++] = pager_scanned;
+        } else {
+            pager_scanned = end;
+            pager_scanned_lines += want - k;
         }
+        if (pager_scanned / PAGER_CHUNK > chunk) pagerDrop(chunk);
     }
+}
 
-    // handle same-line selection
-    if (start_y == end_y) {
-        if (start_x == end_x) {
-            visual_mode = 0;
-            snprintf(statusmsg, sizeof(statusmsg), "[Deleted 0 chars]");
-            return;
-        }
-        int len = strlen(lines[start_y]);
-        memmove(&lines[start_y][start_x], &lines[start_y][end_x], len - end_x + 1);
-        lines[start_y] = realloc(lines[start_y], len - (end_x - start_x) + 1);
-        cx = start_x;
-        cy = start_y;
-    } else {
-        // handle multi-line selection
-        // first line: keep text before start_x
-        int first_len = strlen(lines[start_y]);
-        lines[start_y] = realloc(lines[start_y], start_x + 1);
-        lines[start_y][start_x] = '\0';
+// only meaningful once the whole file is scanned
+static long long pagerTotal() {
+    return pager_scanned_lines + (pager_size > 0 && pager_map[pager_size - 1] != '\n');
+}
 
-        // last line: keep text after end_x
-        int last_len = strlen(lines[end_y]);
-        char *last_part = malloc(last_len - end_x + 1);
-        strcpy(last_part, &lines[end_y][end_x]);
-        free(lines[end_y]);
-        lines[end_y] = last_part;
+// line number of the byte at off, counted from the nearest mark before it
+static long long pagerLineAt(off_t off) {
+    pagerIndex(off + 1);
+    int lo = 0, hi = pager_num_marks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (pager_marks[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    long long k = INT64_MAX;
+    nthNewline(pager_map + pager_marks[lo], off - pager_marks[lo], &k);
+    return (long long)lo * PAGER_STEP + (INT64_MAX - k);
+}
 
-        // concatenate first and last lines
-        int new_len = strlen(lines[start_y]) + strlen(lines[end_y]) + 1;
-        lines[start_y] = realloc(lines[start_y], new_len);
-        strcat(lines[start_y], lines[end_y]);
-        free(lines[end_y]);
+static void pagerUp(long long n) {
+    while (n-- > 0 && pager_top > 0) {
+        pager_top = pagerLineStart(pager_top - 1);
+        pager_line--;
+    }
+}
 
-        // shift lines up
-        for (int i = end_y; i < num_lines - 1; i++) {
-            lines[i] = lines[i + 1];
-        }
-        lines[num_lines - 1] = NULL;
+// scrolling stops once the last line is on screen
+static void pagerDown(long long n) {
+    off_t below = pagerSkip(pager_top, active_pane->rows);
+    while (n-- > 0 && below < (off_t)pager_size) {
+        pager_top = pagerSkip(pager_top, 1);
+        below = pagerSkip(below, 1);
+        pager_line++;
+    }
+}
 
-        // remove intermediate lines
-        for (int i = start_y + 1; i < end_y; i++) {
-            free(lines[i]);
-            lines[i] = NULL;
-        }
-        for (int i = start_y + 1; i < num_lines - (end_y - start_y); i++) {
-            lines[i] = lines[i + (end_y - start_y)];
-        }
-        for (int i = num_lines - (end_y - start_y); i < num_lines; i++) {
-            lines[i] = NULL;
-        }
-        num_lines -= (end_y - start_y);
+// the last page, counting only the bytes not scanned before
+static void pagerEnd() {
+    pagerIndex(pager_size);
+    pager_top = pager_size;
+    pager_line = pagerTotal();
+    pagerUp(active_pane->rows);
+}
 
-        cx = start_x;
-        cy = start_y;
+void enterPagerView() {
+    if (B->scratch) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't page! %.40s is not a file.", B->filename);
+        return;
     }
-
-    // exit visual mode
+    if (mapFile(B->filename, &pager_map, &pager_size) == -1) {
+        snprintf(statusmsg, sizeof(statusmsg), "Can't page! mmap error.");
+        return;
+    }
+    pager_marks_cap = 64;
+    pager_marks = malloc(pager_marks_cap * sizeof(off_t));
+    if (!pager_marks) die("malloc");
+    pager_marks[0] = 0;
+    pager_num_marks = 1;
+    pager_scanned = 0;
+    pager_scanned_lines = 0;
+    pager_top = 0;
+    pager_line = 0;
+    pager_coloff = 0;
+    pager_match = -1;
+    pager_changed = 0;
+    pager_view = 1;
     visual_mode = 0;
-    snprintf(statusmsg, sizeof(statusmsg), "[Deleted %d chars]", deleted_chars);
+    clearCursors();
+    snprintf(statusmsg, sizeof(statusmsg), "[Pager] Read-only, / search, F follow");
+}
 
-    // adjust scroll offset
-    if (cy < rowoff) {
-        rowoff = cy;
+void exitPagerView() {
+    if (!pager_view) return;
+
+    if (pager_map) munmap(pager_map, pager_size);
+    pager_map = NULL;
+    pager_size = 0;
+    free(pager_marks);
+    pager_marks = NULL;
+    pager_view = 0;
+    snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+
+    // catch the text view up with what changed on disk meanwhile
+    if (pager_changed && !B->large) {
+        if (B->follow_mode) ingestAppend();
+        else if (!B->dirty) reloadFile();
+        else snprintf(statusmsg, sizeof(statusmsg), "[Changed on disk] Ctrl-O reload, Ctrl-S overwrite");
+    }
+}
+
+// line is from 0; past the end shows the last line
+void pagerGotoLine(long long line) {
+    if (line < 0) line = 0;
+    while (pager_num_marks <= line / PAGER_STEP && pager_scanned < (off_t)pager_size) {
+        pagerIndex(pager_scanned + PAGER_CHUNK);
     }
-    if (cy >= rowoff + editor_rows) {
-        rowoff = cy - editor_rows + 1;
+    int k = line / PAGER_STEP < pager_num_marks ? line / PAGER_STEP : pager_num_marks - 1;
+    off_t off = pagerSkip(pager_marks[k], line - (long long)k * PAGER_STEP);
+    if (off >= (off_t)pager_size && line > 0) {
+        off = pager_size > 0 ? pagerLineStart(pager_size - 1) : 0;
+        line = pager_size > 0 ? pagerLineAt(off) : 0;
     }
+    pager_top = off;
+    pager_line = line;
 }
 
-void pasteClipboard() {
-    if (!clipboard) return;
+void pagerGotoByte(off_t off) {
+    if (off >= (off_t)pager_size) off = pager_size - 1;
+    if (off < 0) off = 0;
+    pager_top = pagerLineStart(off);
+    pager_line = pagerLineAt(pager_top);
+}
 
-    for (int i = 0; i < clip_len; i++) {
-        if (clipboard[i] == '\n') {
-            insertNewline();
-        } else {
-            insertChar(clipboard[i]);
+// chunk by chunk, dropping the pages of every chunk searched through
+static off_t pagerFind(off_t from, int dir) {
+    const char *q = B->search_query;
+    size_t m = B->search_query_len;
+    if (dir > 0) {
+        for (off_t at = from; at + (off_t)m <= (off_t)pager_size;) {
+            off_t chunk = at / PAGER_CHUNK;
+            off_t end = (chunk + 1) * PAGER_CHUNK; // matches starting before end
+            if (end > (off_t)pager_size) end = pager_size;
+            off_t lim = end + (off_t)m - 1 < (off_t)pager_size ? end + (off_t)m - 1 : (off_t)pager_size;
+            const char *hit = findPattern(pager_map + at, lim - at, q, m);
+            if (hit) return hit - pager_map;
+            pagerDrop(chunk);
+            at = end;
+        }
+    } else {
+        for (off_t at = from; at > 0;) {
+            off_t chunk = (at - 1) / PAGER_CHUNK;
+            off_t start = chunk * PAGER_CHUNK; // matches starting from start, before at
+            off_t lim = at + (off_t)m - 1 < (off_t)pager_size ? at + (off_t)m - 1 : (off_t)pager_size;
+            const char *hit = findPatternBack(pager_map + start, lim - start, q, m);
+            if (hit) return hit - pager_map;
+            pagerDrop(chunk);
+            at = start;
         }
     }
-    snprintf(statusmsg, sizeof(statusmsg), "[Pasted %d chars]", clip_len);
+    return -1;
 }
 
-void saveFile(const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        snprintf(statusmsg, sizeof(statusmsg), "Can't save! fopen error.");
+// the match after the last one (or from the top row), or the one before; the view only moves when it is off screen
+void pagerSearch(int dir) {
+    if (B->search_query_len == 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Pager] No search yet, / starts one");
         return;
     }
-
-    for (int i = 0; i < num_lines; i++) {
-        if (lines[i]) {
-            fprintf(file, "%s\n", lines[i]);
-        }
+    off_t below = pagerSkip(pager_top, active_pane->rows);
+    int shown = pager_match >= pager_top && pager_match < below;
+    off_t from = shown ? pager_match + (dir > 0) : pager_top;
+    off_t at = pagerFind(from, dir);
+    if (at < 0) {
+        snprintf(statusmsg, sizeof(statusmsg), "[Pager] Not found %s: %.40s", dir > 0 ? "below" : "above",
+                 B->search_query);
+        macro_failed = 1;
+        return;
     }
 
-    fclose(file);
-    snprintf(statusmsg, sizeof(statusmsg), "[Saved to %s]", filename);
+    pager_match = at;
+    off_t start = pagerLineStart(at);
+    long long line = pagerLineAt(start);
+    if (at < pager_top || at >= below) {
+        pager_top = start;
+        pager_line = line;
+    }
+    int col = at - start, cols = active_pane->cols;
+    if (col < pager_coloff || col + B->search_query_len > pager_coloff + cols) {
+        pager_coloff = col > cols / 2 ? col - cols / 2 : 0;
+    }
+    snprintf(statusmsg, sizeof(statusmsg), "[Pager] Match at line %lld", line + 1);
 }
 
-void loadFile(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        file = fopen(filename, "w");
-        if (!file) {
-            die("fopen");
-        }
-        fclose(file);
-        return;
+// the mapping has the old size, map the file again; the marks stay valid as long as it only grew
+void pagerReload() {
+    size_t old = pager_size;
+    int at_end = pagerSkip(pager_top, active_pane->rows) >= (off_t)old;
+    if (pager_map) munmap(pager_map, pager_size);
+    if (mapFile(B->filename, &pager_map, &pager_size) == -1) {
+        pager_map = NULL;
+        pager_size = 0;
     }
+    pager_changed = 1;
+    if (pager_size < old) {
+        // truncated or rotated, count again from the start
+        pager_num_marks = 1;
+        pager_scanned = 0;
+        pager_scanned_lines = 0;
+        pager_top = 0;
+        pager_line = 0;
+        pager_match = -1;
+    }
+    // keep tailing only if the user was already looking at the end
+    if (B->follow_mode && at_end) pagerEnd();
+    snprintf(statusmsg, sizeof(statusmsg), "[Pager] %+lld bytes on disk", (long long)pager_size - (long long)old);
+}
 
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t nread;
-
-    num_lines = 0;
-    while ((nread = getline(&line, &len, file)) != -1) {
-        line[strcspn(line, "\n")] = 0;
-        lines[num_lines] = malloc(strlen(line) + 1);
-        strcpy(lines[num_lines], line);
-        num_lines++;
+// commands while paging, addresses are lines of the file; returns 0 for the ones runCommand runs as usual
+int pagerCommand(const char *cmd) {
+    const char *p = cmd;
+    char *end;
+    if (*p == '\0') return 1;
+    if (isdigit((unsigned char)*p)) {
+        long long n = strtoll(p, &end, 10);
+        if (*end == '%' && !end[1]) pagerGotoByte(n >= 100 ? (off_t)pager_size : (off_t)(pager_size * n / 100));
+        else if (*end == '\0') pagerGotoLine(n - 1);
+        else snprintf(statusmsg, sizeof(statusmsg), "[Command] Bad range");
+    } else if (strcmp(p, "$") == 0) {
+        pagerEnd();
+    } else if (strncmp(p, "goto", 4) == 0) {
+        pagerGotoByte(atoll(p + 4) - 1);
+    } else if (strcmp(p, "pager") == 0) {
+        if (B->large) snprintf(statusmsg, sizeof(statusmsg), "[Pager] Too big to edit, it has no text view");
+        else exitPagerView();
+    } else if (strcmp(p, "q") == 0 || (*p == 'e' && p[1] == ' ')) {
+        return 0;
+    } else {
+        snprintf(statusmsg, sizeof(statusmsg), "[Pager] Read-only, :%.40s can't run here", p);
     }
+    return 1;
+}
 
-    free(line);
-    fclose(file);
+// keys while the pager is up, less-style
+void pagerKeypress(int c) {
+    int rows = active_pane->rows, cols = active_pane->cols;
+    if (c == '\x1b' || c == 'q') {
+        if (B->large) snprintf(statusmsg, sizeof(statusmsg), "[Pager] Too big to edit, Ctrl-Q quits");
+        else exitPagerView();
+    } else if (c == CTRL_KEY('q')) {
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        exit(0);
+    } else if (c == CTRL_KEY('e')) {
+        enterCommandMode();
+        return;
+    } else if (c == CTRL_KEY('f') || c == '/') {
+        enterSearchMode();
+        return;
+    } else if (c == CTRL_KEY('n')) {
+        switchBuffer(1);
+    } else if (c == CTRL_KEY('t') || c == 'F') {
+        B->follow_mode = !B->follow_mode;
+        if (B->follow_mode) pagerEnd();
+        snprintf(statusmsg, sizeof(statusmsg), B->follow_mode ? "[Pager] Following %.40s" : "[Pager] Stopped following %.40s",
+                 B->filename);
+    } else if (c == 'n') {
+        pagerSearch(1);
+    } else if (c == 'p' || c == 'N') {
+        pagerSearch(-1);
+    } else if (c == ARROW_DOWN || c == 'j' || c == '\r') {
+        pagerDown(1);
+    } else if (c == ARROW_UP || c == 'k') {
+        pagerUp(1);
+    } else if (c == ' ' || c == 'f') {
+        pagerDown(rows);
+    } else if (c == 'b') {
+        pagerUp(rows);
+    } else if (c == 'd') {
+        pagerDown(rows / 2);
+    } else if (c == 'u') {
+        pagerUp(rows / 2);
+    } else if (c == 'g') {
+        pager_top = 0;
+        pager_line = 0;
+    } else if (c == 'G') {
+        pagerEnd();
+    } else if (c == ARROW_RIGHT) {
+        pager_coloff += cols / 2;
+    } else if (c == ARROW_LEFT) {
+        pager_coloff = pager_coloff > cols / 2 ? pager_coloff - cols / 2 : 0;
+    }
+    editorRefreshScreen();
 }
 
 void processKeypress() {
@@ -653,52 +6472,171 @@ void processKeypress() {
 
     // no input, skip
     if (c == 0) return;
+    if (c != '\t') complete_count = 0;
+
+    if (diff_view) {
+        // the diff view is read-only, keys only scroll it
+        if (c == '\x1b' || c == CTRL_KEY('d')) {
+            exitDiffView();
+        } else if (c == ARROW_DOWN && diff_rowoff < diff_rows - 1) {
+            diff_rowoff++;
+        } else if (c == ARROW_UP && diff_rowoff > 0) {
+            diff_rowoff--;
+        } else if (c == 'n') {
+            diffJumpHunk(1);
+        } else if (c == 'p') {
+            diffJumpHunk(-1);
+        }
+        editorRefreshScreen();
+        return;
+    }
+
+    if (hex_view && !B->search_mode) {
+        hexKeypress(c);
+        return;
+    }
+
+    if (pager_view && !B->search_mode) {
+        pagerKeypress(c);
+        return;
+    }
 
     // Esc always returns to normal mode
     if (c == '\x1b') {
         visual_mode = 0;
-        if (search_mode) exitSearchMode();
-        else snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+        pane_prefix = 0;
+        register_prefix = 0;
+        mark_prefix = 0;
+        yank_register = -1;
+        if (B->search_mode) {
+            exitSearchMode();
+        } else {
+            clearCursors();
+            if (B->filter_on) {
+                toggleFilterView();
+            } else {
+                snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+            }
+        }
         editorRefreshScreen();
         return;
     }
 
-    if (search_mode == 1) {
+    if (B->search_mode == 1) {
         // entering search query
-        if (c == '\r') { // Enter
+        if (c == '\r' && prompt_kind == PROMPT_GREP) {
+            B->search_mode = 0;
+            startGrep(B->search_query);
+            editorRefreshScreen();
+        } else if (c == '\r' && prompt_kind == PROMPT_COMMAND) {
+            B->search_mode = 0;
+            runCommand(B->search_query);
+            editorRefreshScreen();
+        } else if (c == '\r' && prompt_kind == PROMPT_MACRO) {
+            B->search_mode = 0;
+            playMacro(B->search_query_len ? atoi(B->search_query) : 1);
+        } else if (c == '\r') { // Enter
             performSearch();
         } else if (c == 127) { // Backspace
-            if (search_query_len > 0) {
-                search_query[--search_query_len] = '\0';
-                snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Enter query: %s", search_query);
+            if (B->search_query_len > 0) {
+                B->search_query[--B->search_query_len] = '\0';
+                snprintf(statusmsg, sizeof(statusmsg), "%s%s", prompt_label, B->search_query);
                 editorRefreshScreen();
             }
-        } else if (c >= 32 && c <= 126 && search_query_len < MAX_SEARCH_LEN - 1) {
-            search_query[search_query_len++] = c;
-            search_query[search_query_len] = '\0';
-            snprintf(statusmsg, sizeof(statusmsg), "[Search Mode] Enter query: %s", search_query);
+        } else if (c >= 32 && c <= 126 && B->search_query_len < MAX_SEARCH_LEN - 1) {
+            B->search_query[B->search_query_len++] = c;
+            B->search_query[B->search_query_len] = '\0';
+            snprintf(statusmsg, sizeof(statusmsg), "%s%s", prompt_label, B->search_query);
             editorRefreshScreen();
         }
         return;
-    } else if (search_mode == 2) {
+    } else if (B->search_mode == 2) {
         // active search mode
         if (c == 'n') {
             findNext();
         } else if (c == 'p') {
             findPrevious();
+        } else if (c == CTRL_KEY('a')) {
+            addCursorAtNextMatch();
+            editorRefreshScreen();
+        } else if (c == '&') {
+            toggleFilterView();
+            editorRefreshScreen();
+        }
+        return;
+    }
+
+    if (pane_prefix) {
+        pane_prefix = 0;
+        if (c == 's') splitPane('h');
+        else if (c == 'v') splitPane('v');
+        else if (c == 'w' || c == CTRL_KEY('w')) focusNextPane();
+        else if (c == 'q') closePane();
+        editorRefreshScreen();
+        return;
+    }
+
+    if (mark_prefix) {
+        int kind = mark_prefix;
+        mark_prefix = 0;
+        if (kind == CTRL_KEY('x')) setMark(c);
+        else jumpMark(c);
+        editorRefreshScreen();
+        return;
+    }
+
+    if (register_prefix) {
+        int kind = register_prefix;
+        register_prefix = 0;
+        if (kind == '"' && c >= 'a' && c <= 'z') {
+            yank_register = c - 'a';
+            snprintf(statusmsg, sizeof(statusmsg), "[Visual Mode] yank into \"%c", c);
+        } else if (kind == CTRL_KEY('r')) {
+            pasteRegister(c);
         }
+        editorRefreshScreen();
         return;
     }
 
-    if (c == CTRL_KEY('q')) {
+    if (c == CTRL_KEY('w')) {
+        pane_prefix = 1;
+        snprintf(statusmsg, sizeof(statusmsg), "[Pane] s split, v vsplit, w next, q close");
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('q')) {
         write(STDOUT_FILENO, "\x1b[2J", 4);
         write(STDOUT_FILENO, "\x1b[H", 3);
         exit(0);
     } else if (c == CTRL_KEY('f')) {
         enterSearchMode();
+    } else if (c == CTRL_KEY('g')) {
+        enterGrepMode();
     } else if ((c == CTRL_KEY('v') || c == 'v') && !visual_mode) {
         toggleVisualMode();
         editorRefreshScreen();
+    } else if (c == '"' && visual_mode) {
+        register_prefix = '"';
+    } else if (c == CTRL_KEY('e')) {
+        enterCommandMode();
+    } else if (c == CTRL_KEY('b')) {
+        toggleFold();
+        scrollToCursor();
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('k')) {
+        toggleMacroRecording();
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('p')) {
+        enterMacroPrompt();
+    } else if (c == CTRL_KEY('x') || c == CTRL_KEY('y')) {
+        mark_prefix = c;
+        snprintf(statusmsg, sizeof(statusmsg), c == CTRL_KEY('x') ? "[Mark] set mark a-z" : "[Mark] jump to mark a-z");
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('r')) {
+        register_prefix = CTRL_KEY('r');
+        snprintf(statusmsg, sizeof(statusmsg), "[Paste] register a-z or yank 0-9");
+        editorRefreshScreen();
+    } else if (c == 'b' && visual_mode) {
+        toggleBlockMode();
+        editorRefreshScreen();
     } else if (c == 'y' && visual_mode) {
         copySelection();
         editorRefreshScreen();
@@ -711,23 +6649,59 @@ void processKeypress() {
     } else if (c == 'p' && !visual_mode) {
         pasteClipboard();
         editorRefreshScreen();
+    } else if (c == '=' && visual_mode) {
+        int top = sy < B->cy ? sy : B->cy, bottom = sy < B->cy ? B->cy : sy;
+        visual_mode = 0;
+        reindentLines(top, bottom);
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY(']')) {
+        jumpToBracket();
+        editorRefreshScreen();
     } else if (visual_mode) {
         moveCursor(c); // allow cursor movement in visual mode
         editorRefreshScreen();
     } else if (c == 127) { // backspace
         deleteChar();
         editorRefreshScreen();
+    } else if (c == '\r' && B->scratch) { // open the grep hit under the cursor
+        jumpToGrepResult();
+        editorRefreshScreen();
     } else if (c == '\r') { // Enter
+        auto_indent = 1;
         insertNewline();
+        auto_indent = 0;
+        editorRefreshScreen();
+    } else if (c == '\t' && B->csv_delim) {
+        csvJumpField(1);
+        editorRefreshScreen();
+    } else if (c == SHIFT_TAB && B->csv_delim) {
+        csvJumpField(-1);
+        editorRefreshScreen();
+    } else if (c == '\t') {
+        completeWord();
         editorRefreshScreen();
     } else if (c == CTRL_KEY('s')) {
-        saveFile(current_filename);
+        saveFile(B->filename);
         editorRefreshScreen();
     } else if (c == CTRL_KEY('o')) { // Open
-        loadFile(current_filename);
+        reloadFile();
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('l')) { // add a cursor on the next line
+        addCursorBelow();
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('n')) { // next buffer
+        switchBuffer(1);
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('d')) { // diff against the saved file
+        enterDiffView();
+        editorRefreshScreen();
+    } else if (c == CTRL_KEY('t')) { // follow (tail -f)
+        toggleFollowMode();
         editorRefreshScreen();
     } else if (c >= 32 && c <= 126) {
+        auto_indent = 1;
         insertChar(c);
+        auto_indent = 0;
         editorRefreshScreen();
     } else {
         moveCursor(c);
@@ -735,169 +6709,471 @@ void processKeypress() {
     }
 }
 
-void editorDrawRows() {
-    for (int y = 0; y < editor_rows; y++) {
-        int file_y = y + rowoff;
-        if (file_y < num_lines && lines[file_y]) {
-            if (visual_mode) {
-                // determine if this row is within the selection
-                int start_y = sy < cy ? sy : cy;
-                int end_y = sy < cy ? cy : sy;
-                if (file_y >= start_y && file_y <= end_y) {
-                    int start_x, end_x;
-                    if (sy == cy) {
-                        // same-line selection
-                        start_x = sx < cx ? sx : cx;
-                        end_x = sx < cx ? cx : sx;
-                    } else if (file_y == start_y) {
-                        // first line of multi-line selection
-                        start_x = (file_y == sy) ? sx : (file_y == cy) ? cx : 0;
-                        end_x = strlen(lines[file_y]);
-                    } else if (file_y == end_y) {
-                        // last line of multi-line selection
-                        start_x = 0;
-                        end_x = (file_y == sy) ? sx : (file_y == cy) ? cx : strlen(lines[file_y]);
-                    } else {
-                        // middle line of multi-line selection
-                        start_x = 0;
-                        end_x = strlen(lines[file_y]);
-                    }
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *b = realloc(ab->b, ab->len + len);
+    if (!b) die("realloc");
+    memcpy(&b[ab->len], s, len);
+    ab->b = b;
+    ab->len += len;
+}
 
-                    // write line with highlighting
-                    int len = strlen(lines[file_y]);
-                    for (int x = 0; x < len; x++) {
-                        if (x >= start_x && x < end_x) {
-                            write(STDOUT_FILENO, "\x1b[7m", 4); // reverse video (highlight)
-                            write(STDOUT_FILENO, &lines[file_y][x], 1);
-                            write(STDOUT_FILENO, "\x1b[0m", 4); // reset
-                        } else {
-                            write(STDOUT_FILENO, &lines[file_y][x], 1);
-                        }
-                    }
-                } else {
-                    write(STDOUT_FILENO, lines[file_y], strlen(lines[file_y]));
-                }
-            } else if (search_mode == 2 && num_matches > 0) {
-                // highlight search matches
-                int len = strlen(lines[file_y]);
-                int x = 0;
-                while (x < len) {
-                    int is_match = 0;
-                    for (int i = 0; i < num_matches; i++) {
-                        if (search_matches[i].y == file_y && search_matches[i].x == x) {
-                            is_match = 1;
-                            break;
-                        }
-                    }
-                    if (is_match) {
-                        write(STDOUT_FILENO, "\x1b[44m", 5); // blue background
-                        for (int j = 0; j < search_query_len && x + j < len; j++) {
-                            write(STDOUT_FILENO, &lines[file_y][x + j], 1);
-                        }
-                        write(STDOUT_FILENO, "\x1b[0m", 4); // reset
-                        x += search_query_len;
-                    } else {
-                        write(STDOUT_FILENO, &lines[file_y][x], 1);
-                        x++;
-                    }
-                }
+static int drawDiffRow(struct Pane *p, int row, struct abuf *ab) {
+    // inline diff: deleted disk lines in red, added buffer lines in green
+    if (row >= diff_rows) {
+        abAppend(ab, "~", 1);
+        return 1;
+    }
+    int line;
+    int kind = diffRowAt(row, &line);
+    const char *text = kind == '-' ? diff_disk.ptr[line] : p->buf->lines[line] ? p->buf->lines[line] : "";
+    int len = kind == '-' ? diff_disk.len[line] : (int)strlen(text);
+    if (len > p->cols - 1) len = p->cols - 1;
+    if (kind == '-') abAppend(ab, "\x1b[31m", 5);
+    else if (kind == '+') abAppend(ab, "\x1b[32m", 5);
+    char mark = kind;
+    abAppend(ab, &mark, 1);
+    abAppend(ab, text, len);
+    if (kind != ' ') abAppend(ab, "\x1b[0m", 4);
+    return len + 1;
+}
+
+// offset, hex and text columns for one row, read straight from the mapping and the patches
+static int drawHexRow(struct Pane *p, off_t row, struct abuf *ab) {
+    int per = hexPerRow();
+    off_t start = row * per;
+    if (start >= (off_t)hex_size) {
+        abAppend(ab, "~", 1);
+        return 1;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%0*llx  ", hexDigits(), (long long)start);
+    abAppend(ab, buf, len);
+
+    unsigned char bytes[16];
+    int patched[16];
+    int n = hex_size - start < (size_t)per ? (int)(hex_size - start) : per;
+    int i = hexFind(start);
+    for (int k = 0; k < n; k++) {
+        patched[k] = i < hex_num_patches && hex_patches[i].off == start + k;
+        bytes[k] = patched[k] ? hex_patches[i++].byte : (unsigned char)hex_map[start + k];
+    }
+
+    // changed bytes in yellow, the byte under the cursor in reverse video in the column not being typed in
+    for (int col = 0; col < 2; col++) {
+        for (int k = 0; k < per; k++) {
+            if (k >= n) {
+                if (col == 0) abAppend(ab, "   ", 3);
+                continue;
+            }
+            int at_cursor = p == active_pane && start + k == hex_cursor && col != hex_text;
+            if (patched[k]) abAppend(ab, "\x1b[33m", 5);
+            if (at_cursor) abAppend(ab, "\x1b[7m", 4);
+            if (col == 0) {
+                snprintf(buf, sizeof(buf), "%02x", bytes[k]);
+                abAppend(ab, buf, 2);
+            } else {
+                char ch = isprint(bytes[k]) ? bytes[k] : '.';
+                abAppend(ab, &ch, 1);
+            }
+            if (patched[k] || at_cursor) abAppend(ab, "\x1b[0m", 4);
+            if (col == 0) abAppend(ab, " ", 1);
+        }
+        if (col == 0) abAppend(ab, " ", 1);
+    }
+    return len + per * 3 + 1 + n;
+}
+
+// first search match on each visible row, rebuilt only when the view or the matches change
+static void updateHighlightCache(struct Pane *p) {
+    struct Buffer *buf = p->buf;
+    if (p->hl_gen == buf->match_gen && p->hl_rowoff == p->rowoff && p->hl_rows == p->rows) return;
+
+    p->hl_first = realloc(p->hl_first, (p->rows + 1) * sizeof(int));
+    // matches are sorted by line, binary search the first visible one
+    int rows = numRows(buf);
+    int top = p->rowoff < rows ? rowToLine(buf, p->rowoff) : buf->num_lines;
+    int lo = 0, hi = buf->num_matches;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (buf->search_matches[mid].y < top) lo = mid + 1;
+        else hi = mid;
+    }
+    for (int y = 0; y < p->rows; y++) {
+        int line = p->rowoff + y < rows ? rowToLine(buf, p->rowoff + y) : buf->num_lines;
+        while (lo < buf->num_matches && buf->search_matches[lo].y < line) lo++;
+        p->hl_first[y] = (lo < buf->num_matches && buf->search_matches[lo].y == line) ? lo : -1;
+    }
+    p->hl_gen = buf->match_gen;
+    p->hl_rowoff = p->rowoff;
+    p->hl_rows = p->rows;
+}
+
+// bytes as they are, except control characters, which would move the terminal cursor
+static void pagerText(struct abuf *ab, const char *s, int n) {
+    char buf[256];
+    while (n > 0) {
+        int k = n < (int)sizeof(buf) ? n : (int)sizeof(buf);
+        for (int i = 0; i < k; i++) {
+            unsigned char ch = s[i];
+            buf[i] = ch == '\t' || ch == '\r' ? ' ' : ch < 32 || ch == 127 ? '.' : ch;
+        }
+        abAppend(ab, buf, k);
+        s += k;
+        n -= k;
+    }
+}
+
+// one line straight from the mapped file, matches of the last search in blue; *off moves to the next line
+static int drawPagerRow(struct Pane *p, off_t *off, struct abuf *ab) {
+    if (*off >= (off_t)pager_size) {
+        abAppend(ab, "~", 1);
+        return 1;
+    }
+    const char *line = pager_map + *off;
+    size_t left = pager_size - *off;
+    long long k = 1;
+    size_t len = nthNewline(line, left, &k);
+    *off += len < left ? len + 1 : len;
+    if (len <= (size_t)pager_coloff) return 0;
+    line += pager_coloff;
+    len -= pager_coloff;
+    int n = len < (size_t)p->cols ? (int)len : p->cols;
+
+    int m = pager_match >= 0 ? B->search_query_len : 0;
+    size_t span = len < (size_t)(n + m) ? len : (size_t)(n + m - 1); // matches starting on screen
+    int x = 0;
+    while (x < n) {
+        const char *hit = m ? findPattern(line + x, span - x, B->search_query, m) : NULL;
+        int next = hit ? hit - line : n;
+        pagerText(ab, line + x, next - x);
+        if (!hit) break;
+        int end = next + m < n ? next + m : n;
+        abAppend(ab, "\x1b[44m", 5); // blue background
+        pagerText(ab, line + next, end - next);
+        abAppend(ab, "\x1b[0m", 4);
+        x = end;
+    }
+    return n;
+}
+
+static int drawLineText(struct Pane *p, int y, int file_y, struct abuf *ab) {
+    struct Buffer *buf = p->buf;
+    if (buf->csv_delim) return drawCsvLine(p, file_y, ab);
+    char *line = buf->lines[file_y];
+    int len = strlen(line);
+    if (len > p->cols) len = p->cols;
+
+    if (visual_mode && p == active_pane) {
+        // determine if this row is within the selection
+        int start_y = sy < p->cy ? sy : p->cy;
+        int end_y = sy < p->cy ? p->cy : sy;
+        if (file_y < start_y || file_y > end_y) {
+            abAppend(ab, line, len);
+            return len;
+        }
+        int start_x, end_x;
+        if (visual_mode == 2) {
+            // block: same columns on every row
+            start_x = sx < p->cx ? sx : p->cx;
+            end_x = (sx < p->cx ? p->cx : sx) + 1;
+        } else if (sy == p->cy) {
+            // same-line selection
+            start_x = sx < p->cx ? sx : p->cx;
+            end_x = sx < p->cx ? p->cx : sx;
+        } else if (file_y == start_y) {
+            // first line of multi-line selection
+            start_x = (file_y == sy) ? sx : (file_y == p->cy) ? p->cx : 0;
+            end_x = len;
+        } else if (file_y == end_y) {
+            // last line of multi-line selection
+            start_x = 0;
+            end_x = (file_y == sy) ? sx : (file_y == p->cy) ? p->cx : len;
+        } else {
+            // middle line of multi-line selection
+            start_x = 0;
+            end_x = len;
+        }
+        if (start_x > len) start_x = len;
+        if (end_x > len) end_x = len;
+
+        abAppend(ab, line, start_x);
+        abAppend(ab, "\x1b[7m", 4); // reverse video (highlight)
+        abAppend(ab, &line[start_x], end_x - start_x);
+        abAppend(ab, "\x1b[0m", 4); // reset
+        abAppend(ab, &line[end_x], len - end_x);
+    } else if (buf->search_mode == 2 && buf->num_matches > 0) {
+        // highlight search matches
+        updateHighlightCache(p);
+        int m = p->hl_first[y];
+        int x = 0;
+        while (x < len) {
+            while (m >= 0 && m < buf->num_matches && buf->search_matches[m].y == file_y &&
+                   buf->search_matches[m].x < x) m++;
+            int next = len;
+            if (m >= 0 && m < buf->num_matches && buf->search_matches[m].y == file_y) {
+                next = buf->search_matches[m].x < len ? buf->search_matches[m].x : len;
+            }
+            if (next == x) {
+                int end = x + buf->search_query_len < len ? x + buf->search_query_len : len;
+                abAppend(ab, "\x1b[44m", 5); // blue background
+                abAppend(ab, &line[x], end - x);
+                abAppend(ab, "\x1b[0m", 4); // reset
+                x = end;
             } else {
-                write(STDOUT_FILENO, lines[file_y], strlen(lines[file_y]));
+                abAppend(ab, &line[x], next - x);
+                x = next;
             }
+        }
+    } else if (bracket_hl_on && p == active_pane && (file_y == bracket_hl[0].y || file_y == bracket_hl[1].y)) {
+        // the bracket under the cursor and its partner
+        int x = 0;
+        for (int k = 0; k < 2; k++) {
+            struct Cursor *c = &bracket_hl[k ^ (bracket_hl[0].y == bracket_hl[1].y && bracket_hl[0].x > bracket_hl[1].x)];
+            if (c->y != file_y || c->x < x || c->x >= len) continue;
+            abAppend(ab, &line[x], c->x - x);
+            abAppend(ab, "\x1b[46m", 5); // cyan background
+            abAppend(ab, &line[c->x], 1);
+            abAppend(ab, "\x1b[0m", 4);
+            x = c->x + 1;
+        }
+        abAppend(ab, &line[x], len - x);
+    } else {
+        abAppend(ab, line, len);
+    }
+    return len;
+}
+
+// returns the number of columns written so the caller can pad the row
+static int drawBufferRow(struct Pane *p, int y, struct abuf *ab) {
+    struct Buffer *buf = p->buf;
+    int row = y + p->rowoff;
+    int file_y = row < numRows(buf) ? rowToLine(buf, row) : buf->num_lines;
+    if (file_y >= buf->num_lines || !buf->lines[file_y]) {
+        abAppend(ab, "~", 1);
+        return 1;
+    }
+    int len = drawLineText(p, y, file_y, ab);
+
+    // fold headers say how much is tucked under them
+    int folded = buf->num_folds ? foldAt(buf, file_y) : 0;
+    if (folded && len < p->cols) {
+        char mark[32];
+        int n = snprintf(mark, sizeof(mark), " [+%d lines]", folded);
+        if (n > p->cols - len) n = p->cols - len;
+        abAppend(ab, "\x1b[2m", 4); // dim
+        abAppend(ab, mark, n);
+        abAppend(ab, "\x1b[0m", 4);
+        len += n;
+    }
+    return len;
+}
+
+// extra cursors are painted over the finished row in reverse video
+static void drawExtraCursors(struct Pane *p, int y, struct abuf *ab) {
+    int row = y + p->rowoff;
+    int file_y = row < numRows(B) ? rowToLine(B, row) : -1;
+    char buf[32];
+    for (int i = 0; i < B->num_cursors; i++) {
+        struct Cursor *cur = &B->cursors[i];
+        if (cur->y != file_y || cur->x >= p->cols) continue;
+        char *line = B->lines[file_y];
+        char ch = line && cur->x < (int)strlen(line) ? line[cur->x] : ' ';
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH\x1b[7m", p->top + y + 1, p->left + cur->x + 1);
+        abAppend(ab, buf, strlen(buf));
+        abAppend(ab, &ch, 1);
+        abAppend(ab, "\x1b[0m", 4);
+    }
+}
+
+static void drawPane(struct Pane *p, struct abuf *ab) {
+    char buf[32];
+    extendFilter(p->buf);
+    // another pane may have shrunk the view under this one
+    int rows = numRows(p->buf);
+    if (p != active_pane && p->rowoff >= rows) p->rowoff = rows > p->rows ? rows - p->rows : 0;
+    if (p->buf->csv_delim) csvMeasure(p);
+    off_t pager_off = pager_top;
+    for (int y = 0; y < p->rows; y++) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", p->top + y + 1, p->left + 1);
+        abAppend(ab, buf, strlen(buf));
+        int written;
+        if (diff_view == 2 && p == active_pane) {
+            written = drawDiffRow(p, y + diff_rowoff, ab);
+        } else if (hex_view && p == active_pane) {
+            written = drawHexRow(p, y + hex_rowoff, ab);
+        } else if (pager_view && p == active_pane) {
+            written = drawPagerRow(p, &pager_off, ab);
         } else {
-            write(STDOUT_FILENO, "~", 1);
+            written = drawBufferRow(p, y, ab);
+        }
+        // pad instead of clearing to end of line so side-by-side panes survive
+        for (int x = written; x < p->cols; x++) abAppend(ab, " ", 1);
+        if (p == active_pane && B->num_cursors > 0) drawExtraCursors(p, y, ab);
+    }
+}
+
+static void drawSeparators(struct Pane *p, struct abuf *ab) {
+    if (!p->split) return;
+
+    char buf[32];
+    if (p->split == 'h') {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", p->second->top, p->left + 1);
+        abAppend(ab, buf, strlen(buf));
+        for (int x = 0; x < p->cols; x++) abAppend(ab, "-", 1);
+    } else {
+        for (int y = 0; y < p->rows; y++) {
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH|", p->top + y + 1, p->second->left);
+            abAppend(ab, buf, strlen(buf));
         }
-        write(STDOUT_FILENO, "\r\n", 2);
     }
+    drawSeparators(p->first, ab);
+    drawSeparators(p->second, ab);
+}
+
+static void drawDamaged(struct Pane *p, struct abuf *ab) {
+    if (p->split) {
+        drawDamaged(p->first, ab);
+        drawDamaged(p->second, ab);
+    } else if (p->damaged || full_redraw) {
+        drawPane(p, ab);
+        p->damaged = 0;
+    }
+}
+
+void editorDrawRows(struct abuf *ab) {
+    saveViewport();
+    damageBuffer(B);
+    updateBracketHighlight();
+
+    if (full_redraw) {
+        abAppend(ab, "\x1b[2J", 4);
+        drawSeparators(root_pane, ab);
+    }
+    drawDamaged(root_pane, ab);
+    full_redraw = 0;
 }
 
 void updateWindowSize() {
     struct winsize ws;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
         // If ioctl fails or reports 0, use defaults
-        editor_rows = 24;
-        editor_cols = 80;
+        screen_rows = 24;
+        screen_cols = 80;
     } else {
         // Subtract 1 row for the status bar
-        editor_rows = ws.ws_row - 1;
-        editor_cols = ws.ws_col;
+        screen_rows = ws.ws_row - 1;
+        screen_cols = ws.ws_col;
     }
 
     window_resized = 0;
+    layoutPanes(root_pane, 0, 0, screen_rows, screen_cols);
+    editor_rows = active_pane->rows;
+    editor_cols = active_pane->cols;
+    full_redraw = 1;
 }
 
-void drawStatusBar() {
-    updateWindowSize();
-
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        // fallback to a reasonable default if ioctl fails
-        ws.ws_row = editor_rows + 1;
-        ws.ws_col = editor_cols;
-    }
-
+void drawStatusBar(struct abuf *ab) {
     // move to the bottom row
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;1H", ws.ws_row);
-    write(STDOUT_FILENO, buf, strlen(buf));
+    snprintf(buf, sizeof(buf), "\x1b[%d;1H", screen_rows + 1);
+    abAppend(ab, buf, strlen(buf));
 
     // clear the line and enable reverse video
-    write(STDOUT_FILENO, "\x1b[K", 3); // Clear line
-    write(STDOUT_FILENO, "\x1b[7m", 4); // Reverse video
+    abAppend(ab, "\x1b[K", 3); // Clear line
+    abAppend(ab, "\x1b[7m", 4); // Reverse video
 
     // write status message, truncate if too long
     int msg_len = strlen(statusmsg);
-    if (msg_len > ws.ws_col) msg_len = ws.ws_col;
-    write(STDOUT_FILENO, statusmsg, msg_len);
+    if (msg_len > screen_cols) msg_len = screen_cols;
+    abAppend(ab, statusmsg, msg_len);
+
+    // counts for the selection or the whole buffer on the right, if they fit
+    char stats[80];
+    int lines = B->num_lines;
+    int stats_len;
+    if (hex_view) {
+        stats_len = snprintf(stats, sizeof(stats), "%d changed 0x%llx/0x%llx", hex_num_patches,
+                             (long long)hex_cursor, (long long)hex_size);
+    } else if (pager_view) {
+        off_t below = pagerSkip(pager_top, active_pane->rows);
+        int pct = pager_size ? (int)(below * 100 / pager_size) : 100;
+        if (pager_scanned == (off_t)pager_size) {
+            stats_len = snprintf(stats, sizeof(stats), "line %lld/%lld %d%%", pager_line + 1, pagerTotal(), pct);
+        } else {
+            stats_len = snprintf(stats, sizeof(stats), "line %lld/? %d%%", pager_line + 1, pct);
+        }
+    } else {
+        struct LineStats st = visual_mode ? selectionStats(&lines) : bufferStats(B, 0, B->num_lines - 1);
+        stats_len = snprintf(stats, sizeof(stats), "%s%dL %lldW %lldB %lldC", visual_mode ? "sel " : "",
+                             lines, st.words, st.bytes, st.chars);
+    }
+    if (msg_len + stats_len + 2 > screen_cols) stats_len = 0;
 
     // Pad with spaces to fill the row
-    for (int i = msg_len; i < ws.ws_col; i++) {
-        write(STDOUT_FILENO, " ", 1);
+    for (int i = msg_len; i < screen_cols - stats_len; i++) {
+        abAppend(ab, " ", 1);
     }
+    abAppend(ab, stats, stats_len);
 
     // reset attributes
-    write(STDOUT_FILENO, "\x1b[0m", 4);
+    abAppend(ab, "\x1b[0m", 4);
 }
 
 void editorRefreshScreen() {
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if (macro_playing) return; // drawn once when playback ends
+    struct abuf ab = {NULL, 0};
+    if (window_resized) updateWindowSize();
 
-    // draw editor content and status bar at bottom
-    editorDrawRows();
-    drawStatusBar();
+    abAppend(&ab, "\x1b[?25l", 6); // hide cursor while drawing
+
+    // draw damaged panes and status bar at bottom
+    editorDrawRows(&ab);
+    drawStatusBar(&ab);
 
     // move cursor to editor position
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) {
-        ws.ws_row = editor_rows + 1;
-    }
     char buf[32];
-    if (search_mode == 1) {
+    if (diff_view == 2) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", active_pane->top + 1, active_pane->left + 1);
+    } else if (hex_view && B->search_mode != 1) {
+        int per = hexPerRow(), k = hex_cursor % per;
+        int col = hexDigits() + 2 + (hex_text ? per * 3 + 1 + k : k * 3 + hex_low);
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", active_pane->top + (int)(hex_cursor / per - hex_rowoff) + 1,
+                 active_pane->left + col + 1);
+    } else if (pager_view && B->search_mode != 1) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", active_pane->top + 1, active_pane->left + 1);
+    } else if (B->search_mode == 1) {
         // keep cursor at status bar for query input
-        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", ws.ws_row, (int)strlen(statusmsg) + 1);
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", screen_rows + 1, (int)strlen(statusmsg) + 1);
     } else {
-        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy - rowoff + 1, cx + 1);
+        int x = B->csv_delim ? csvScreenX(B, B->cy, B->cx) : B->cx;
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", active_pane->top + lineToRow(B, B->cy) - B->rowoff + 1,
+                 active_pane->left + x + 1);
     }
-    write(STDOUT_FILENO, buf, strlen(buf));
+    abAppend(&ab, buf, strlen(buf));
+    abAppend(&ab, "\x1b[?25h", 6);
 
-    fflush(stdout); // ensure immediate output
+    write(STDOUT_FILENO, ab.b, ab.len);
+    free(ab.b);
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <filename>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <filename> [filename...]\n", argv[0]);
         return 1;
     }
 
-    current_filename = argv[1];
-    loadFile(current_filename);
+    for (int i = 1; i < argc; i++) {
+        B = newBuffer(argv[i]);
+        loadFile(B->filename);
+        startWatch(B->filename);
+    }
+    current_buffer = 0;
+    B = buffers[0];
+    root_pane = active_pane = newPane(B);
     visual_mode = 0;
-    search_mode = 0;
-    clipboard = NULL;
-    clip_len = 0;
-    rowoff = 0;
     snprintf(statusmsg, sizeof(statusmsg), "[Normal Mode]");
+    if (B->binary) enterHexView();
+    if (B->large) enterPagerView();
 
     setupResizeHandler();
     enableRawMode();
@@ -906,6 +7182,21 @@ int main(int argc, char *argv[]) {
         if (window_resized) {
             editorRefreshScreen();
         }
+        pollDiffView();
+        pollWordIndex();
+        if (pollGrep()) editorRefreshScreen();
+        if (!diff_view && pollWatch() && !B->binary) {
+            if (pager_view) {
+                pagerReload();
+            } else if (B->follow_mode) {
+                ingestAppend();
+            } else if (!B->dirty) {
+                reloadFile();
+            } else {
+                snprintf(statusmsg, sizeof(statusmsg), "[Changed on disk] Ctrl-O reload, Ctrl-S overwrite");
+            }
+            editorRefreshScreen();
+        }
         processKeypress();
     }
 